@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Storage for objects of T addressed by 32-bit indices, index 0 standing for none. Chunks
+// double in size, the first one holds kFirstChunk objects, and are not freed while the arena is
+// in use, so the memory of a released object is reused only as another T. Allocate() hands out
+// raw storage, the caller constructs and destroys the objects in place.
+// The arena is shared by all users of T, each holds a Lease. Its memory only grows to the peak
+// number of objects in use at once, and goes back to the system when the last lease is gone.
+// Every thread keeps a cache of free indices and trades whole batches with the others, see
+// TypeStablePool.
+template <class T, size_t BatchSize = 64>
+class Arena {
+public:
+    // indices must leave a bit for tagging
+    static constexpr uint32_t kMaxIndex = (1u << 31) - 1;
+    static constexpr uint32_t kFirstChunkBits = 10;
+    static constexpr uint32_t kFirstChunk = 1u << kFirstChunkBits;
+    static_assert(kFirstChunk % BatchSize == 0, "a batch must not straddle chunks");
+
+    // every index must have been released before the last lease goes
+    class Lease {
+    public:
+        Lease() {
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            ++shared.leases;
+        }
+
+        ~Lease() {
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            if (--shared.leases == 0) {
+                FreeChunks(shared);
+            }
+        }
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+    };
+
+    static uint32_t Allocate() {
+        std::vector<uint32_t> &cache = LocalCache();
+        if (cache.empty()) {
+            Refill(cache);
+        }
+        uint32_t index = cache.back();
+        cache.pop_back();
+        return index;
+    }
+
+    static void Release(uint32_t index) {
+        std::vector<uint32_t> &cache = LocalCache();
+        cache.push_back(index);
+        if (cache.size() >= 2 * BatchSize) {
+            std::vector<uint32_t> batch(cache.end() - BatchSize, cache.end());
+            cache.resize(cache.size() - BatchSize);
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            shared.batches.push_back(std::move(batch));
+        }
+    }
+
+    static T *At(uint32_t index) {
+        uint32_t position = index - 1 + kFirstChunk;
+        int chunk = std::bit_width(position) - 1 - kFirstChunkBits;
+        return chunks_[chunk].load(std::memory_order_acquire) +
+               (position - (kFirstChunk << chunk));
+    }
+
+    static uint32_t IndexOf(const T *object) {
+        for (int chunk = 0; chunk < kMaxChunks; ++chunk) {
+            T *begin = chunks_[chunk].load(std::memory_order_acquire);
+            if (begin != nullptr && object >= begin && object < begin + ChunkSize(chunk)) {
+                return static_cast<uint32_t>((kFirstChunk << chunk) - kFirstChunk +
+                                             (object - begin) + 1);
+            }
+        }
+        return 0;
+    }
+
+private:
+    static constexpr int kMaxChunks = 32 - kFirstChunkBits;
+
+    struct Shared {
+        std::mutex mutex;
+        std::vector<std::vector<uint32_t>> batches;
+        // positions handed out so far
+        uint32_t next{0};
+        size_t leases{0};
+    };
+
+    // a thread hands its free indices over to the others when it exits
+    struct Cache {
+        std::vector<uint32_t> indices;
+        // of the chunks the indices point into
+        uint64_t generation{0};
+
+        ~Cache() {
+            if (indices.empty()) {
+                return;
+            }
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            if (generation == generation_.load(std::memory_order_relaxed)) {
+                shared.batches.push_back(std::move(indices));
+            }
+        }
+    };
+
+    static size_t ChunkSize(int chunk) {
+        return static_cast<size_t>(kFirstChunk) << chunk;
+    }
+
+    // intentionally never destroyed, the objects must outlive every user
+    static Shared &GetShared() {
+        static Shared *shared = new Shared;
+        return *shared;
+    }
+
+    static std::vector<uint32_t> &LocalCache() {
+        static thread_local Cache cache;
+        // the chunks were freed since the cache was filled, by the users this thread served
+        uint64_t generation = generation_.load(std::memory_order_relaxed);
+        if (cache.generation != generation) {
+            cache.indices.clear();
+            cache.generation = generation;
+        }
+        return cache.indices;
+    }
+
+    static void Refill(std::vector<uint32_t> &cache) {
+        Shared &shared = GetShared();
+        std::lock_guard lock(shared.mutex);
+        if (!shared.batches.empty()) {
+            cache = std::move(shared.batches.back());
+            shared.batches.pop_back();
+            return;
+        }
+        if (shared.next > kMaxIndex - BatchSize) {
+            throw std::runtime_error("Arena overflow");
+        }
+        uint32_t first = shared.next + 1;
+        shared.next += BatchSize;
+        uint32_t position = first - 1 + kFirstChunk;
+        int chunk = std::bit_width(position) - 1 - kFirstChunkBits;
+        if (chunks_[chunk].load(std::memory_order_relaxed) == nullptr) {
+            auto *storage = static_cast<T *>(::operator new(sizeof(T) * ChunkSize(chunk)));
+            chunks_[chunk].store(storage, std::memory_order_release);
+        }
+        for (uint32_t i = 0; i < BatchSize; ++i) {
+            cache.push_back(first + i);
+        }
+    }
+
+    // under the mutex; the cache of every thread is dropped the next time it is used
+    static void FreeChunks(Shared &shared) {
+        for (auto &chunk : chunks_) {
+            ::operator delete(chunk.exchange(nullptr, std::memory_order_relaxed));
+        }
+        shared.batches.clear();
+        shared.next = 0;
+        generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static inline std::atomic<T *> chunks_[kMaxChunks]{};
+    static inline std::atomic<uint64_t> generation_{0};
+};
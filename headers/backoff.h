@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Exponential backoff with jitter for retrying a failed CAS. Every retry waits a random
+// number of pauses below a limit that doubles up to MaxSpins, so threads that collided once
+// do not collide again in lockstep. Past the limit the thread also yields, in case the one
+// it waits for is not running. MaxSpins = 0 retries at once.
+template <int MaxSpins>
+class Backoff {
+public:
+    void Pause() {
+        if constexpr (MaxSpins > 0) {
+            int spins = 1 + static_cast<int>(NextRandom() % static_cast<uint64_t>(limit_));
+            for (int i = 0; i < spins; ++i) {
+                CpuRelax();
+            }
+            if (limit_ == MaxSpins) {
+                std::this_thread::yield();
+            }
+            limit_ = std::min(2 * limit_, MaxSpins);
+        }
+    }
+
+private:
+    static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // xorshift, good enough to spread the waits
+    static uint64_t NextRandom() {
+        static thread_local uint64_t state =
+            0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>(&state);
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    int limit_{1};
+};
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <memory>
 #include <random>
 #include <thread>
 #include <vector>
@@ -23,3 +26,34 @@ private:
     std::mt19937 gen_;
     std::uniform_int_distribution<int> dist_;
 };
+
+// Draws ranks from [0, n) with P(k) proportional to 1 / (k + 1)^skew, rank 0 being the
+// hottest. Copies share the table, so one generator per thread is cheap.
+class Zipf {
+public:
+    Zipf(uint32_t seed, size_t n, double skew = 0.99) : gen_{seed}, cdf_{MakeCdf(n, skew)} {
+    }
+    size_t operator()() {
+        double u = dist_(gen_);
+        auto it = std::lower_bound(cdf_->begin(), cdf_->end(), u);
+        return std::min<size_t>(it - cdf_->begin(), cdf_->size() - 1);
+    }
+
+private:
+    static std::shared_ptr<const std::vector<double>> MakeCdf(size_t n, double skew) {
+        auto cdf = std::make_shared<std::vector<double>>(n);
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            sum += 1.0 / std::pow(static_cast<double>(k + 1), skew);
+            (*cdf)[k] = sum;
+        }
+        for (double &value : *cdf) {
+            value /= sum;
+        }
+        return cdf;
+    }
+
+    std::mt19937 gen_;
+    std::uniform_real_distribution<double> dist_{0.0, 1.0};
+    std::shared_ptr<const std::vector<double>> cdf_;
+};
@@ -0,0 +1,368 @@
+#pragma once
+
+#include "arena.h"
+#include "backoff.h"
+#include "hazard_ptr.h"
+#include "hashers.h"
+#include "kv_layouts.h"
+#include "striped_counter.h"
+#include "unordered_cc_map.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <optional>
+
+namespace sinking_tree {
+
+// SinkingTree with 32-bit slots: cells and entries live in Arenas and are referred to by
+// tagged indices, so a Cell takes 8 bytes and a cache line holds 16 root slots. Made for
+// hundreds of millions of entries, where pointers would take most of the memory.
+// Read-mostly only: the tree is loaded and updated by Put and read by Get, entries are never
+// erased and cells never collapsed. Anything more (Erase, bulk operations, Clear, layouts
+// other than a plain node per entry) is what SinkingTree is for. Put and the sinking are
+// those of SinkingTree over Refs, keep them in step.
+// The arenas are shared by all trees of the same type and freed along with the last of them.
+template <class Key, class Value, class Hasher = DefaultHasher<Key>,
+          class Policy = DefaultPolicy>
+class CompactSinkingTree {
+    // 0 - empty
+    // odd - a Cell, index << 1 | 1
+    // even - an entry, index << 1
+    using Ref = uint32_t;
+
+    struct Root {
+        size_t bit_count;
+        std::atomic<Ref> refs[];
+    };
+
+    struct Cell {
+        std::atomic<Ref> halves[2]{};
+    };
+    static_assert(sizeof(Cell) == 8);
+
+    struct Entry {
+        Key key;
+        Value value;
+
+        // retired entries are deleted by the hazard manager, their storage goes back to the
+        // arena
+        static void operator delete(Entry *entry, std::destroying_delete_t) {
+            entry->~Entry();
+            Arena<Entry>::Release(Arena<Entry>::IndexOf(entry));
+        }
+    };
+
+    using TreeTraverser = sinking_tree::TreeTraverser<const Key &, Hasher>;
+
+    static constexpr int kMaxSolidity_ = 8 * sizeof(HashType);
+
+public:
+    CompactSinkingTree(size_t capacity = 2, Hasher hasher = Hasher());
+    ~CompactSinkingTree();
+
+    // false if it replaced the value of the key
+    bool Put(const Key &key, const Value &value);
+    std::optional<Value> Get(const Key &key);
+
+    // never blocks; exact while no modifications run concurrently, approximate otherwise
+    size_t Size() const;
+    bool Empty() const;
+    // walks the whole tree, must not run concurrently with modifications
+    size_t ExactSize() const;
+
+    CompactSinkingTree(const CompactSinkingTree &other) = delete;
+    CompactSinkingTree operator=(const CompactSinkingTree &other) = delete;
+    CompactSinkingTree(CompactSinkingTree &&other) = delete;
+    CompactSinkingTree operator=(CompactSinkingTree &&other) = delete;
+
+    void CleanupHazard();
+
+private:
+    static Cell *CellAt(Ref ref) {
+        return Arena<Cell>::At(ref >> 1);
+    }
+
+    static Entry *EntryAt(Ref ref) {
+        return Arena<Entry>::At(ref >> 1);
+    }
+
+    // loads a slot, protecting the entry if it holds one
+    static Ref LoadEntry(typename Hazard<Entry>::Mutator &, std::atomic<Ref> &);
+    static Root *NewRoot(size_t bit_count);
+    void Sink();
+    bool SinkDue() const;
+    bool SinkOnce();
+    static void FreeSlot(Ref);
+    static size_t CountEntries(Ref);
+
+    // declared first, the manager below returns entries to the arena when destroyed
+    typename Arena<Cell>::Lease cell_lease_;
+    typename Arena<Entry>::Lease entry_lease_;
+    std::atomic<Root *> root_;
+    std::array<Root *, kMaxSolidity_> old_roots_{};
+    // cells per level, the level of a cell being the number of bits that lead to it
+    std::atomic<size_t> cell_count_[kMaxSolidity_]{};
+    std::atomic<bool> sinking_{false};
+    StripedCounter<> size_;
+    Hasher hasher_;
+    Hazard<Entry>::Manager manager_;
+};
+
+// definitions
+
+template <class Key, class Value, class Hasher, class Policy>
+CompactSinkingTree<Key, Value, Hasher, Policy>::CompactSinkingTree(size_t capacity, Hasher hasher)
+    : hasher_(hasher) {
+    size_t bit_count = 1;
+    while (power(bit_count) < capacity) {
+        bit_count++;
+    }
+    root_.store(NewRoot(bit_count), std::memory_order_release);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto CompactSinkingTree<Key, Value, Hasher, Policy>::NewRoot(size_t bit_count) -> Root * {
+    size_t root_size = power(bit_count);
+    Root *root =
+        reinterpret_cast<Root *>(malloc(sizeof(Root) + sizeof(std::atomic<Ref>) * root_size));
+    root->bit_count = bit_count;
+    for (size_t i = 0; i < root_size; ++i) {
+        new (&root->refs[i]) std::atomic<Ref>(0);
+    }
+    return root;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto CompactSinkingTree<Key, Value, Hasher, Policy>::LoadEntry(
+    typename Hazard<Entry>::Mutator &mutator, std::atomic<Ref> &slot) -> Ref {
+    return mutator.Protect(0, slot, [](Ref ref) -> Entry * {
+        return ref == 0 || (ref & 1) ? nullptr : EntryAt(ref);
+    });
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool CompactSinkingTree<Key, Value, Hasher, Policy>::Put(const Key &key, const Value &value) {
+    auto mutator = manager_.MakeMutator();
+    Backoff<Policy::kMaxBackoff> backoff;
+
+    TreeTraverser traverser(key, hasher_);
+    Root *root = root_.load(std::memory_order_acquire);
+    std::atomic<Ref> *slot = &root->refs[traverser.Advance(root->bit_count)];
+
+    Ref desired = Arena<Entry>::Allocate() << 1;
+    ::new (EntryAt(desired)) Entry{key, value};
+    // a split that lost its CAS keeps the cell for the next attempt
+    Ref spare = 0;
+
+    while (true) {
+        Ref expected = slot->load(std::memory_order_acquire);
+        if (expected & 1) {
+            slot = &CellAt(expected)->halves[traverser.Advance()];
+            continue;
+        }
+        if (expected == 0) {
+            if (slot->compare_exchange_weak(expected, desired, std::memory_order_acq_rel)) {
+                break;
+            }
+            backoff.Pause();
+            continue;
+        }
+        expected = LoadEntry(mutator, *slot);
+        if (expected == 0 || (expected & 1)) {
+            continue;
+        }
+        Entry *entry = EntryAt(expected);
+        if (entry->key == key) {
+            if (slot->compare_exchange_weak(expected, desired, std::memory_order_acq_rel)) {
+                if (spare != 0) {
+                    Arena<Cell>::Release(spare >> 1);
+                }
+                mutator.Retire(entry);
+                return false;
+            }
+            backoff.Pause();
+            continue;
+        }
+        // push the entry one level down into a new cell
+        if (spare == 0) {
+            spare = Arena<Cell>::Allocate() << 1 | 1;
+            ::new (CellAt(spare)) Cell;
+        }
+        TreeTraverser repath(entry->key, hasher_);
+        repath.Advance(traverser.BitsConsumed());
+        int index = repath.Advance();
+        CellAt(spare)->halves[index].store(expected, std::memory_order_relaxed);
+        CellAt(spare)->halves[1 - index].store(0, std::memory_order_relaxed);
+        if (!slot->compare_exchange_weak(expected, spare, std::memory_order_acq_rel)) {
+            backoff.Pause();
+            continue;
+        }
+        spare = 0;
+        int solidity = traverser.BitsConsumed();
+        if (solidity <= kMaxSolidity_) {
+            auto before = cell_count_[solidity - 1].fetch_add(1);
+            if (solidity > 1 && before + 1 == power(solidity) &&
+                solidity - static_cast<int>(root->bit_count) > 1) {
+                Sink();
+            }
+        }
+        // go on through the new cell
+    }
+
+    if (spare != 0) {
+        Arena<Cell>::Release(spare >> 1);
+    }
+    size_.Add(1);
+    return true;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+std::optional<Value> CompactSinkingTree<Key, Value, Hasher, Policy>::Get(const Key &key) {
+    TreeTraverser traverser(key, hasher_);
+    Root *root = root_.load(std::memory_order_acquire);
+    std::atomic<Ref> *slot = &root->refs[traverser.Advance(root->bit_count)];
+    Ref ref = slot->load(std::memory_order_acquire);
+
+    while (true) {
+        if (ref & 1) {
+            slot = &CellAt(ref)->halves[traverser.Advance()];
+            ref = slot->load(std::memory_order_acquire);
+            continue;
+        }
+        if (ref == 0) {
+            return std::nullopt;
+        }
+        auto mutator = manager_.MakeMutator();
+        ref = LoadEntry(mutator, *slot);
+        if (ref == 0 || (ref & 1)) {
+            continue;
+        }
+        const Entry *entry = EntryAt(ref);
+        std::optional<Value> ret_val;
+        if (entry->key == key) {
+            ret_val = entry->value;
+        }
+        return ret_val;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t CompactSinkingTree<Key, Value, Hasher, Policy>::Size() const {
+    return static_cast<size_t>(size_.Load());
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool CompactSinkingTree<Key, Value, Hasher, Policy>::Empty() const {
+    return Size() == 0;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t CompactSinkingTree<Key, Value, Hasher, Policy>::ExactSize() const {
+    Root *root = root_.load(std::memory_order_acquire);
+    size_t count = 0;
+    for (size_t i = 0; i < power(root->bit_count); ++i) {
+        count += CountEntries(root->refs[i].load(std::memory_order_acquire));
+    }
+    return count;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t CompactSinkingTree<Key, Value, Hasher, Policy>::CountEntries(Ref ref) {
+    if (ref == 0) {
+        return 0;
+    } else if (ref & 1) {
+        Cell *cell = CellAt(ref);
+        return CountEntries(cell->halves[0].load(std::memory_order_acquire)) +
+               CountEntries(cell->halves[1].load(std::memory_order_acquire));
+    } else {
+        return 1;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void CompactSinkingTree<Key, Value, Hasher, Policy>::Sink() {
+    // whoever sinks also takes over the levels the others fill meanwhile
+    while (SinkDue()) {
+        if (sinking_.exchange(true, std::memory_order_acq_rel)) {
+            return;
+        }
+        while (SinkDue() && SinkOnce()) {
+        }
+        sinking_.store(false, std::memory_order_release);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool CompactSinkingTree<Key, Value, Hasher, Policy>::SinkDue() const {
+    // the level two below the root is full
+    int solidity = root_.load(std::memory_order_acquire)->bit_count + 2;
+    return solidity <= kMaxSolidity_ &&
+           cell_count_[solidity - 1].load(std::memory_order_acquire) == power(solidity);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool CompactSinkingTree<Key, Value, Hasher, Policy>::SinkOnce() {
+    Root *root = root_.load(std::memory_order_acquire);
+    size_t rs = power(root->bit_count);
+    Root *new_root = NewRoot(root->bit_count + 1);
+
+    for (size_t i = 0; i < rs; ++i) {
+        Ref ref = root->refs[i].load();
+        Ref lhs = 0;
+        Ref rhs = 0;
+        if (ref & 1) {
+            lhs = CellAt(ref)->halves[0].load();
+            rhs = CellAt(ref)->halves[1].load();
+        }
+        if (!(lhs & 1) || !(rhs & 1)) {
+            free(new_root);
+            return false;
+        }
+        new_root->refs[i].store(lhs, std::memory_order_relaxed);
+        new_root->refs[i + rs].store(rhs, std::memory_order_relaxed);
+    }
+    root_.store(new_root, std::memory_order_release);
+    // readers may still go through it, the cells below are shared with the new root
+    old_roots_[root->bit_count] = root;
+    return true;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void CompactSinkingTree<Key, Value, Hasher, Policy>::FreeSlot(Ref ref) {
+    if (ref & 1) {
+        Cell *cell = CellAt(ref);
+        FreeSlot(cell->halves[0].load(std::memory_order_relaxed));
+        FreeSlot(cell->halves[1].load(std::memory_order_relaxed));
+        Arena<Cell>::Release(ref >> 1);
+    } else if (ref != 0) {
+        delete EntryAt(ref);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+CompactSinkingTree<Key, Value, Hasher, Policy>::~CompactSinkingTree() {
+    // the cells of the old roots gave their children to the next root
+    for (Root *old : old_roots_) {
+        if (old == nullptr) {
+            continue;
+        }
+        for (size_t i = 0; i < power(old->bit_count); ++i) {
+            Arena<Cell>::Release(old->refs[i].load(std::memory_order_relaxed) >> 1);
+        }
+        free(old);
+    }
+    Root *root = root_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < power(root->bit_count); ++i) {
+        FreeSlot(root->refs[i].load(std::memory_order_relaxed));
+    }
+    free(root);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void CompactSinkingTree<Key, Value, Hasher, Policy>::CleanupHazard() {
+    manager_.Cleanup();
+}
+}  // namespace sinking_tree
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdint>
 #include <functional>
 
@@ -9,7 +11,7 @@ typedef uint64_t HashType;
 
 namespace hashers {
 
-HashType MurmurHash64A(uint64_t k, uint64_t seed) {
+inline HashType MurmurHash64A(uint64_t k, uint64_t seed) {
     const uint64_t m = 0xc6a4a7935bd1e995;
     const int r = 47;
     uint64_t h = seed ^ (8 * m);
@@ -24,7 +26,7 @@ HashType MurmurHash64A(uint64_t k, uint64_t seed) {
     return h;
 }
 
-HashType MurmurHash64A(const void *key, int len, uint64_t seed) {
+inline HashType MurmurHash64A(const void *key, int len, uint64_t seed) {
     const uint64_t m = 0xc6a4a7935bd1e995;
     const int r = 47;
     uint64_t h = seed ^ (len * m);
@@ -65,10 +67,12 @@ HashType MurmurHash64A(const void *key, int len, uint64_t seed) {
 template <class Key, bool = std::is_integral<Key>::value>
 struct DefaultHasher;
 
+// Key is a contiguous container, views of the same elements get the same hash
 template <class Key>
 struct DefaultHasher<Key, false> {
-    HashType operator()(const Key &key, uint64_t seed) {
-        return MurmurHash64A(key.data(), key.size() * sizeof(Key), seed);
+    template <class Contiguous>
+    HashType operator()(const Contiguous &key, uint64_t seed) {
+        return MurmurHash64A(key.data(), key.size() * sizeof(*key.data()), seed);
     }
 };
 
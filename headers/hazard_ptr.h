@@ -3,6 +3,11 @@
 #include <algorithm>
 #include <atomic>
 #include <array>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
 template <typename T, size_t ProtectedPointersPerThread = 1, size_t MaxThreadCount = 64,
@@ -16,35 +21,111 @@ class Hazard {
         std::array<std::atomic<T*>, ProtectedPointersPerThread> protected_pointers;
         std::array<T*, BatchCap> retired_pointers;
         size_t retired_count{0};
+        // a default-constructed id marks a record released by its thread and free to claim
+        std::atomic<std::thread::id> owner;
     };
 
-    static inline thread_local ThreadState* registry = nullptr;
+    // A thread may work with any number of managers of the same type, so its records are
+    // looked up in a small direct-mapped cache keyed by the id of the manager. A miss falls
+    // back to a scan over the records of the manager itself.
+    struct CacheEntry {
+        uint64_t manager_id{0};
+        ThreadState* state{nullptr};
+    };
+
+    static constexpr size_t kCacheSize = 256;
+
+    static inline thread_local std::array<CacheEntry, kCacheSize> registry{};
+    // ids are never reused, so an entry left behind by a dead manager can never be hit
+    static inline std::atomic<uint64_t> manager_id_counter{0};
+
+    static uint64_t NextManagerId() {
+        return 1 + manager_id_counter.fetch_add(1, std::memory_order_relaxed);
+    }
 
 public:
     class Mutator;
+    class Manager;
+
+private:
+    // The managers alive right now, for a thread to give up its records in all of them when it
+    // exits. Intentionally never destroyed, managers with static storage may outlive it.
+    struct LiveManagers {
+        std::mutex mutex;
+        std::vector<Manager*> managers;
+    };
+
+    static LiveManagers& Live() {
+        static LiveManagers* live = new LiveManagers;
+        return *live;
+    }
+
+    struct ThreadExit {
+        ~ThreadExit() {
+            LiveManagers& live = Live();
+            std::lock_guard lock(live.mutex);
+            for (Manager* manager : live.managers) {
+                manager->ReleaseThread();
+            }
+        }
+    };
+
+public:
 
     class Manager {
     public:
+        Manager() : id_(NextManagerId()) {
+            LiveManagers& live = Live();
+            std::lock_guard lock(live.mutex);
+            live.managers.push_back(this);
+        }
+
+        Manager(const Manager&) = delete;
+        Manager& operator=(const Manager&) = delete;
+
         Mutator MakeMutator() {
-            if (registry == nullptr) {
-                size_t thread_id = thread_counter_.fetch_add(1, std::memory_order_relaxed);
-                if (thread_id >= MaxThreadCount) {
-                    thread_counter_.fetch_sub(1, std::memory_order_relaxed);
-                    throw std::runtime_error("Max thread count overflow " +
-                                             std::to_string(thread_id));
+            CacheEntry& entry = registry[id_ % kCacheSize];
+            if (entry.manager_id != id_) {
+                entry.state = FindOrRegister();
+                entry.manager_id = id_;
+            }
+            return Mutator(this, entry.state);
+        }
+
+        // Hands the record of the calling thread back to the manager, so that short-lived
+        // threads do not use up MaxThreadCount. Its retired pointers go to the next owner.
+        // Threads do this on exit for every manager they registered in, calling it earlier
+        // only frees the record sooner.
+        void ReleaseThread() {
+            CacheEntry& entry = registry[id_ % kCacheSize];
+            if (entry.manager_id == id_) {
+                entry = CacheEntry{};
+            }
+            // the cache may have lost the record to another manager, look it up
+            auto self = std::this_thread::get_id();
+            size_t threads = thread_counter_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < threads; ++i) {
+                ThreadState* ts = thread_pointers_[i].load(std::memory_order_acquire);
+                if (ts == nullptr || ts->owner.load(std::memory_order_relaxed) != self) {
+                    continue;
                 }
-                registry = new ThreadState;
-                thread_pointers_[thread_id].store(registry, std::memory_order_relaxed);
+                for (auto& atom_pointer : ts->protected_pointers) {
+                    atom_pointer.store(nullptr, std::memory_order_release);
+                }
+                // publishes the retired pointers to whoever claims the record next
+                ts->owner.store(std::thread::id(), std::memory_order_release);
+                return;
             }
-            return Mutator(this, registry);
         }
 
         void Scan(ThreadState* retiring) {
             std::vector<void*> all_protected;
 
-            size_t threads = thread_counter_.load(std::memory_order_relaxed);
+            // a seq_cst read-modify-write keeps the reads of the hazards below from moving
+            // ahead of the unlinking of the retired pointers, pairs with Protect()
+            size_t threads = thread_counter_.fetch_add(0, std::memory_order_seq_cst);
             for (size_t i = 0; i < threads; ++i) {
-                auto* ts = thread_pointers_[i].load(std::memory_order_relaxed);
+                auto* ts = thread_pointers_[i].load(std::memory_order_acquire);
                 if (ts == nullptr) {
                     continue;
                 }
@@ -62,7 +143,8 @@ public:
             std::vector<T*> approved;
             std::vector<T*> dismissed;
 
-            for (T* rptr : retiring->retired_pointers) {
+            for (size_t i = 0; i < retiring->retired_count; ++i) {
+                T* rptr = retiring->retired_pointers[i];
                 if (std::binary_search(all_protected.begin(), all_protected.end(), rptr)) {
                     dismissed.push_back(rptr);
                 } else {
@@ -81,9 +163,14 @@ public:
         }
 
         void Cleanup() {
+            // keeps exiting threads from releasing the records deleted here
+            std::lock_guard lock(Live().mutex);
             size_t threads = thread_counter_.load(std::memory_order_relaxed);
             for (size_t i = 0; i < threads; ++i) {
-                ThreadState* ts = thread_pointers_[i].load(std::memory_order_relaxed);
+                ThreadState* ts = thread_pointers_[i].exchange(nullptr, std::memory_order_relaxed);
+                if (ts == nullptr) {
+                    continue;
+                }
                 for (size_t j = 0; j < ts->retired_count; ++j) {
                     delete ts->retired_pointers[j];
                     ts->retired_pointers[j] = nullptr;
@@ -91,16 +178,63 @@ public:
                 delete ts;
             }
             thread_counter_.store(0, std::memory_order_relaxed);
-            registry = nullptr;
+            // every thread still caches the old records under the old id
+            id_ = NextManagerId();
         }
 
         ~Manager() {
+            {
+                LiveManagers& live = Live();
+                std::lock_guard lock(live.mutex);
+                live.managers.erase(std::find(live.managers.begin(), live.managers.end(), this));
+            }
             Cleanup();
         }
 
     private:
+        ThreadState* FindOrRegister() {
+            // every thread releases its records on exit, whatever manager it registers in first
+            static thread_local ThreadExit thread_exit;
+
+            auto self = std::this_thread::get_id();
+            size_t threads = thread_counter_.load(std::memory_order_acquire);
+            ThreadState* released = nullptr;
+            for (size_t i = 0; i < threads; ++i) {
+                ThreadState* ts = thread_pointers_[i].load(std::memory_order_acquire);
+                if (ts == nullptr) {
+                    continue;
+                }
+                // pairs with the release in ReleaseThread(), the record may have been ours before
+                auto owner = ts->owner.load(std::memory_order_acquire);
+                if (owner == self) {
+                    return ts;
+                } else if (owner == std::thread::id() && released == nullptr) {
+                    released = ts;
+                }
+            }
+            for (size_t i = 0; released != nullptr && i < threads; ++i) {
+                ThreadState* ts = thread_pointers_[i].load(std::memory_order_acquire);
+                auto nobody = std::thread::id();
+                if (ts != nullptr &&
+                    ts->owner.compare_exchange_strong(nobody, self, std::memory_order_acquire)) {
+                    return ts;
+                }
+            }
+
+            size_t thread_id = thread_counter_.fetch_add(1, std::memory_order_relaxed);
+            if (thread_id >= MaxThreadCount) {
+                thread_counter_.fetch_sub(1, std::memory_order_relaxed);
+                throw std::runtime_error("Max thread count overflow " + std::to_string(thread_id));
+            }
+            ThreadState* ts = new ThreadState;
+            ts->owner.store(self, std::memory_order_relaxed);
+            thread_pointers_[thread_id].store(ts, std::memory_order_release);
+            return ts;
+        }
+
         std::array<std::atomic<ThreadState*>, MaxThreadCount> thread_pointers_{};
         std::atomic<size_t> thread_counter_{0};
+        uint64_t id_;
     };
 
     class Mutator {
@@ -114,7 +248,7 @@ public:
         }
 
         template <typename V>
-        T* Protect(size_t index, AtomicPtr<V>& ptr) {
+        T* Protect(size_t index, const AtomicPtr<V>& ptr) {
             if (index >= ProtectedPointersPerThread) {
                 throw std::runtime_error("bad index");
             }
@@ -122,12 +256,35 @@ public:
             T* after = reinterpret_cast<T*>(ptr.load(std::memory_order_relaxed));
             do {
                 before = after;
-                tstate_->protected_pointers[index].store(before, std::memory_order_release);
-                after = reinterpret_cast<T*>(ptr.load(std::memory_order_acquire));
+                // the store must not be reordered with the reload, or a Scan running in
+                // between could miss it and free the pointer we are about to accept
+                tstate_->protected_pointers[index].store(before, std::memory_order_seq_cst);
+                after = reinterpret_cast<T*>(ptr.load(std::memory_order_seq_cst));
+            } while (after != before);
+            return after;
+        }
+
+        // protects filter(value) in place of the loaded value itself, e.g. to strip tag bits
+        // off a pointer or to look an index up, and returns the value as loaded
+        template <typename W, typename Filter>
+        W Protect(size_t index, const std::atomic<W>& ptr, Filter filter) {
+            if (index >= ProtectedPointersPerThread) {
+                throw std::runtime_error("bad index");
+            }
+            W before;
+            W after = ptr.load(std::memory_order_relaxed);
+            do {
+                before = after;
+                tstate_->protected_pointers[index].store(filter(before), std::memory_order_seq_cst);
+                after = ptr.load(std::memory_order_seq_cst);
             } while (after != before);
             return after;
         }
 
+        void Release(size_t index) {
+            tstate_->protected_pointers[index].store(nullptr, std::memory_order_release);
+        }
+
         void Retire(T* ptr) {
             tstate_->retired_pointers[tstate_->retired_count++] = ptr;
             if (tstate_->retired_count == BatchCap) {
@@ -135,6 +292,14 @@ public:
             }
         }
 
+        // frees whatever retired pointers are not protected right now, without waiting for
+        // a full batch
+        void Reclaim() {
+            if (tstate_->retired_count != 0) {
+                manager_->Scan(tstate_);
+            }
+        }
+
     private:
         Manager* manager_;
         ThreadState* tstate_;
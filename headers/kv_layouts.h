@@ -0,0 +1,371 @@
+#pragma once
+
+#include "hashers.h"
+#include "type_stable_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace sinking_tree {
+
+// Compile-time switches of SinkingTree, derive from it to override some of them
+struct DefaultPolicy {
+    // keep small trivially copyable entries in the slot itself, see PackedKV
+    static constexpr bool kPackedEntries = true;
+    // collapse cells left with a lone entry or none on Erase, see SinkingTree::FinishCollapse;
+    // ignored for optimistic reads, see below
+    static constexpr bool kCollapseCells = true;
+    // a failed CAS waits up to that many pauses before the retry, see Backoff
+    static constexpr int kMaxBackoff = 1 << 10;
+    // count failed CASes per root slot, see SinkingTree::GetRetryStats
+    static constexpr bool kRetryStats = false;
+    // keep std::basic_string keys inside the KV node itself, see InlineKeyKV
+    static constexpr bool kInlineKeys = true;
+    // let Get copy trivially copyable entries without protecting anything, see OptimisticKV
+    // and SinkingTree::OptimisticGet; cells are never collapsed then
+    static constexpr bool kOptimisticReads = false;
+    // keep striped entry counts for Size() and Empty(), an increment per Put and Erase and a
+    // cache line per hardware thread, up to 64, for each map, see StripedCounter
+    static constexpr bool kCountEntries = true;
+};
+
+// A layout decides what a tree slot holding an entry contains. The tree only handles
+// that word (an "entry") through the static functions of the layout:
+//   KeyView                       - how the key is handed out and hashed
+//   kHeapNode                     - the entry points to a node which must be protected and
+//                                   retired, otherwise it is self-contained
+//   Make(key, value, hash)        - creates an entry, hash is hasher(key, 0)
+//   KeyOf(entry), ValueOf(entry)
+//   Matches(entry, key, hash)     - key equality, hash is hasher(key, 0)
+//   Free(entry)                   - frees an entry nobody can reach anymore
+// Optionally:
+//   CachedHash(entry)             - hasher(key, 0) stored in the entry
+//   TryRead(entry, slot, key, hash, out) - reads the entry without any protection, false if
+//                                   the copy turned out torn or the entry left the slot and
+//                                   it must be retried
+//   Lease                         - held by the tree for as long as it has entries, for
+//                                   layouts keeping their nodes in a shared pool
+// An entry is never null and its lowest two bits are always zero, they tag Cells and frozen
+// slots. Nodes get that from their alignment, even if K or V is a dataless type, making a
+// set(V = void) with a single-bit key possible.
+
+template <class Key, class Value>
+struct alignas(std::max(4UL, alignof(std::pair<Key, Value>))) PlainKV {
+    using KeyView = const Key &;
+    static constexpr bool kHeapNode = true;
+
+    static void *Make(KeyView key, const Value &value, HashType) {
+        return new PlainKV{key, value};
+    }
+
+    static KeyView KeyOf(const void *entry) {
+        return Node(entry)->key;
+    }
+
+    static const Value &ValueOf(const void *entry) {
+        return Node(entry)->value;
+    }
+
+    static bool Matches(const void *entry, KeyView key, HashType) {
+        return Node(entry)->key == key;
+    }
+
+    static void Free(void *entry) {
+        delete Node(entry);
+    }
+
+    static PlainKV *Node(const void *entry) {
+        return reinterpret_cast<PlainKV *>(const_cast<void *>(entry));
+    }
+
+    Key key;
+    Value value;
+};
+
+// The characters of the key follow the header in the same allocation, so a lookup of a
+// short key touches a single cache line and a mismatch is mostly settled by the hash.
+template <class Char, class Traits, class Value>
+struct alignas(std::max({4UL, alignof(Value), alignof(HashType)})) InlineKeyKV {
+    using KeyView = std::basic_string_view<Char, Traits>;
+    static constexpr bool kHeapNode = true;
+
+    static void *Make(KeyView key, const Value &value, HashType hash) {
+        if (key.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("Key too long for InlineKeyKV " + std::to_string(key.size()));
+        }
+        void *raw = ::operator new(sizeof(InlineKeyKV) + key.size() * sizeof(Char));
+        InlineKeyKV *kv = new (raw) InlineKeyKV(value, hash, static_cast<uint32_t>(key.size()));
+        std::memcpy(kv->Data(), key.data(), key.size() * sizeof(Char));
+        return kv;
+    }
+
+    static KeyView KeyOf(const void *entry) {
+        return Node(entry)->Key();
+    }
+
+    static const Value &ValueOf(const void *entry) {
+        return Node(entry)->value;
+    }
+
+    static bool Matches(const void *entry, KeyView key, HashType hash) {
+        return Node(entry)->hash == hash && Node(entry)->Key() == key;
+    }
+
+    static HashType CachedHash(const void *entry) {
+        return Node(entry)->hash;
+    }
+
+    static void Free(void *entry) {
+        delete Node(entry);
+    }
+
+    static InlineKeyKV *Node(const void *entry) {
+        return reinterpret_cast<InlineKeyKV *>(const_cast<void *>(entry));
+    }
+
+    static void operator delete(void *ptr) {
+        ::operator delete(ptr);
+    }
+
+    // hasher(key, 0), the first hash every traversal starts with
+    HashType hash;
+    uint32_t size;
+    Value value;
+
+private:
+    InlineKeyKV(const Value &value, HashType hash, uint32_t size)
+        : hash(hash), size(size), value(value) {
+    }
+
+    KeyView Key() const {
+        return KeyView(reinterpret_cast<const Char *>(this + 1), size);
+    }
+
+    Char *Data() {
+        return reinterpret_cast<Char *>(this + 1);
+    }
+};
+
+// No node at all: the bits of the key and the value are packed into the slot word above
+// three tag bits, bit 2 set keeps an entry of zeroes apart from an empty slot. Entries are
+// read and swapped by value, so lookups need no hazard protection and nothing is retired.
+template <class Key, class Value>
+struct PackedKV {
+    using KeyView = Key;
+    static constexpr bool kHeapNode = false;
+    static constexpr int kTagBits = 3;
+    static constexpr size_t kPayloadBits = 8 * (sizeof(Key) + sizeof(Value));
+
+    static constexpr bool Fits() {
+        return std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value> &&
+               std::is_default_constructible_v<Key> && std::is_default_constructible_v<Value> &&
+               kPayloadBits <= 8 * sizeof(uintptr_t) - kTagBits;
+    }
+
+    static void *Make(Key key, const Value &value, HashType) {
+        unsigned char bytes[sizeof(Key) + sizeof(Value)];
+        std::memcpy(bytes, &key, sizeof(Key));
+        std::memcpy(bytes + sizeof(Key), &value, sizeof(Value));
+        uintptr_t payload = 0;
+        std::memcpy(&payload, bytes, sizeof(bytes));
+        return reinterpret_cast<void *>((payload << kTagBits) | 0b100);
+    }
+
+    static Key KeyOf(const void *entry) {
+        Key key;
+        uintptr_t payload = Payload(entry);
+        std::memcpy(&key, &payload, sizeof(Key));
+        return key;
+    }
+
+    static Value ValueOf(const void *entry) {
+        unsigned char bytes[sizeof(uintptr_t)];
+        uintptr_t payload = Payload(entry);
+        std::memcpy(bytes, &payload, sizeof(bytes));
+        Value value;
+        std::memcpy(&value, bytes + sizeof(Key), sizeof(Value));
+        return value;
+    }
+
+    static bool Matches(const void *entry, Key key, HashType) {
+        return KeyOf(entry) == key;
+    }
+
+    static void Free(void *) {
+    }
+
+    static uintptr_t Payload(const void *entry) {
+        return reinterpret_cast<uintptr_t>(entry) >> kTagBits;
+    }
+};
+
+// A node whose bytes are stored in atomic words under a sequence number, odd while the node
+// is being written. Nodes live in a TypeStablePool, so a reader holding a pointer to a node
+// that was erased and reused meanwhile still reads a node, and the sequence number tells it
+// that the copy is not to be trusted. Writers still protect and retire the nodes as usual,
+// only reads go without writing anything shared. The pool keeps as many nodes as the trees
+// using it ever held at once, until the last of them is gone.
+template <class Key, class Value>
+struct alignas(16) OptimisticKV {
+    using KeyView = Key;
+    static constexpr bool kHeapNode = true;
+    // the first hash and then the bytes of the key and the value
+    static constexpr size_t kWords = 1 + (sizeof(Key) + sizeof(Value) + 7) / 8;
+
+    static void *Make(Key key, const Value &value, HashType hash) {
+        uint64_t words[kWords] = {};
+        words[0] = hash;
+        std::memcpy(words + 1, &key, sizeof(Key));
+        std::memcpy(reinterpret_cast<unsigned char *>(words + 1) + sizeof(Key), &value,
+                    sizeof(Value));
+
+        OptimisticKV *kv = TypeStablePool<OptimisticKV>::Acquire();
+        uint64_t version = kv->version.load(std::memory_order_relaxed);
+        kv->version.store(version + 1, std::memory_order_relaxed);
+        // release keeps the odd version ahead of the new words
+        for (size_t i = 0; i < kWords; ++i) {
+            kv->words[i].store(words[i], std::memory_order_release);
+        }
+        kv->version.store(version + 2, std::memory_order_release);
+        return kv;
+    }
+
+    static Key KeyOf(const void *entry) {
+        uint64_t words[kWords];
+        Node(entry)->Copy(words);
+        return DecodeKey(words);
+    }
+
+    static Value ValueOf(const void *entry) {
+        uint64_t words[kWords];
+        Node(entry)->Copy(words);
+        return DecodeValue(words);
+    }
+
+    static bool Matches(const void *entry, Key key, HashType hash) {
+        uint64_t words[kWords];
+        Node(entry)->Copy(words);
+        return words[0] == hash && DecodeKey(words) == key;
+    }
+
+    static HashType CachedHash(const void *entry) {
+        return Node(entry)->words[0].load(std::memory_order_relaxed);
+    }
+
+    // The slot is checked between the two reads of the version: a node still in place there
+    // under an even version holds the entry that was published, while a node checked after
+    // the second read may have been freed, reused and put back into the same slot meanwhile.
+    template <class Slot>
+    static bool TryRead(const void *entry, const Slot &slot, Key key, HashType hash,
+                        std::optional<Value> &out) {
+        const OptimisticKV *kv = Node(entry);
+        uint64_t before = kv->version.load(std::memory_order_acquire);
+        if ((before & 1) || slot.load(std::memory_order_acquire) != entry) {
+            return false;
+        }
+        uint64_t words[kWords];
+        // acquire keeps the second read of the version behind the words
+        kv->Copy(words, std::memory_order_acquire);
+        if (kv->version.load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+        if (words[0] == hash && DecodeKey(words) == key) {
+            out = DecodeValue(words);
+        } else {
+            out.reset();
+        }
+        return true;
+    }
+
+    static void Free(void *entry) {
+        TypeStablePool<OptimisticKV>::Release(Node(entry));
+    }
+
+    static OptimisticKV *Node(const void *entry) {
+        return reinterpret_cast<OptimisticKV *>(const_cast<void *>(entry));
+    }
+
+    using Lease = typename TypeStablePool<OptimisticKV>::Lease;
+
+    // retirement deletes nodes, they must stay alive in the pool instead
+    static void operator delete(OptimisticKV *kv, std::destroying_delete_t) {
+        Free(kv);
+    }
+
+    std::atomic<uint64_t> version{0};
+    std::atomic<uint64_t> words[kWords]{};
+
+private:
+    void Copy(uint64_t *out, std::memory_order order = std::memory_order_relaxed) const {
+        for (size_t i = 0; i < kWords; ++i) {
+            out[i] = words[i].load(order);
+        }
+    }
+
+    static Key DecodeKey(const uint64_t *words) {
+        Key key;
+        std::memcpy(&key, words + 1, sizeof(Key));
+        return key;
+    }
+
+    static Value DecodeValue(const uint64_t *words) {
+        Value value;
+        std::memcpy(&value, reinterpret_cast<const unsigned char *>(words + 1) + sizeof(Key),
+                    sizeof(Value));
+        return value;
+    }
+};
+
+template <class Key, class Value, class Hasher, class Policy>
+struct KVLayout {
+    using Type = PlainKV<Key, Value>;
+};
+
+template <class Key, class Value, class Hasher, class Policy>
+    requires(Policy::kPackedEntries && PackedKV<Key, Value>::Fits())
+struct KVLayout<Key, Value, Hasher, Policy> {
+    using Type = PackedKV<Key, Value>;
+};
+
+template <class Key, class Value, class Hasher, class Policy>
+    requires(Policy::kOptimisticReads &&
+             !(Policy::kPackedEntries && PackedKV<Key, Value>::Fits()) &&
+             std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value> &&
+             std::is_default_constructible_v<Key> && std::is_default_constructible_v<Value>)
+struct KVLayout<Key, Value, Hasher, Policy> {
+    using Type = OptimisticKV<Key, Value>;
+};
+
+// the hasher must give a view of the characters the same hash as the string
+template <class Char, class Traits, class Alloc, class Value, class Hasher, class Policy>
+    requires(Policy::kInlineKeys &&
+             std::is_invocable_r_v<HashType, Hasher &, std::basic_string_view<Char, Traits>,
+                                   uint64_t>)
+struct KVLayout<std::basic_string<Char, Traits, Alloc>, Value, Hasher, Policy> {
+    using Type = InlineKeyKV<Char, Traits, Value>;
+};
+
+// the Lease of a layout, or an empty stand-in
+struct NoLease {};
+
+template <class KV>
+struct LeaseOf {
+    using Type = NoLease;
+};
+
+template <class KV>
+    requires requires { typename KV::Lease; }
+struct LeaseOf<KV> {
+    using Type = typename KV::Lease;
+};
+}  // namespace sinking_tree
@@ -1,3 +1,4 @@
+#include <list>
 #include <mutex>
 #include <optional>
 #include <unordered_map>
@@ -32,3 +33,45 @@ private:
     std::unordered_map<Key, Value> map_;
     mutable std::mutex mutex_;
 };
+
+// A cache with least recently used eviction over the same mutex-protected map.
+template <class Key, class Value>
+class LruBaseline {
+public:
+    explicit LruBaseline(size_t capacity) : capacity_(capacity) {
+        map_.reserve(capacity);
+    }
+
+    bool Put(const Key& key, const Value& value) {
+        std::lock_guard lock(mutex_);
+        auto res = map_.find(key);
+        if (res != map_.end()) {
+            res->second->second = value;
+            order_.splice(order_.begin(), order_, res->second);
+            return false;
+        }
+        order_.emplace_front(key, value);
+        map_.emplace(key, order_.begin());
+        if (map_.size() > capacity_) {
+            map_.erase(order_.back().first);
+            order_.pop_back();
+        }
+        return true;
+    }
+    std::optional<Value> Get(const Key& key) {
+        std::lock_guard lock(mutex_);
+        auto res = map_.find(key);
+        if (res == map_.end()) {
+            return std::nullopt;
+        }
+        order_.splice(order_.begin(), order_, res->second);
+        return res->second->second;
+    }
+
+private:
+    using Order = std::list<std::pair<Key, Value>>;
+    Order order_;
+    std::unordered_map<Key, typename Order::iterator> map_;
+    size_t capacity_;
+    mutable std::mutex mutex_;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+// Hands out [begin, end) chunks of an index range to whichever worker asks first, so
+// a worker that drew cheap chunks keeps taking more instead of idling beside a slow one.
+class ChunkCursor {
+public:
+    ChunkCursor(size_t size, size_t workers)
+        : size_(size), chunk_(std::max<size_t>(1, size / (8 * std::max<size_t>(1, workers)))) {
+    }
+
+    bool Next(size_t &begin, size_t &end) {
+        begin = next_.fetch_add(chunk_, std::memory_order_relaxed);
+        if (begin >= size_) {
+            return false;
+        }
+        end = std::min(size_, begin + chunk_);
+        return true;
+    }
+
+private:
+    const size_t size_;
+    const size_t chunk_;
+    std::atomic<size_t> next_{0};
+};
+
+// Runs worker() on the calling thread and on threads - 1 helper threads, returns when all of
+// them are done
+template <class Worker>
+void RunWorkers(size_t threads, Worker &&worker) {
+    std::vector<std::jthread> helpers;
+    for (size_t i = 1; i < threads; ++i) {
+        helpers.emplace_back([&worker] { worker(); });
+    }
+    worker();
+}
+
+// Runs posted tasks one after another on a thread of its own, started by the first Post().
+// The destructor waits for the queue to drain.
+class BackgroundWorker {
+public:
+    BackgroundWorker() = default;
+    BackgroundWorker(const BackgroundWorker &) = delete;
+    BackgroundWorker &operator=(const BackgroundWorker &) = delete;
+
+    ~BackgroundWorker() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void Post(std::function<void()> task) {
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.push_back(std::move(task));
+            if (!thread_.joinable()) {
+                thread_ = std::jthread([this] { Loop(); });
+            }
+        }
+        cv_.notify_one();
+    }
+
+private:
+    void Loop() {
+        std::unique_lock lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_{false};
+    std::jthread thread_;
+};
+}  // namespace parallel
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "striped_counter.h"
+#include "unordered_cc_map.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+namespace sinking_tree {
+
+// A SinkingTree of bounded capacity, for caching in front of a slow store.
+// Capacity counts entries, or whatever weigher(key, value) returns for each entry, bytes say.
+// Once a Put goes over it, entries are evicted by CLOCK: a hand goes round the root slots and
+// erases the entries not referenced since it passed last, clearing the reference bit of the
+// others. Get sets the bit, so a hit costs a plain Get plus a store the first time around.
+// Every thread evicts on its own, the hand is shared. Entries may expire after a TTL, which is
+// checked lazily, by Get and by the hand.
+template <class Key, class Value, class Hasher = DefaultHasher<Key>, class Policy = DefaultPolicy>
+class SinkingCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Weigher = std::function<size_t(const Key &, const Value &)>;
+
+    explicit SinkingCache(size_t capacity, Weigher weigher = nullptr, Hasher hasher = Hasher());
+
+    // a zero ttl never expires
+    bool Put(const Key &key, const Value &value, Clock::duration ttl = Clock::duration::zero());
+    std::optional<Value> Get(const Key &key);
+    bool Erase(const Key &key);
+
+    // both approximate while modifications run concurrently
+    size_t Size() const;
+    size_t Weight() const;
+    size_t Capacity() const;
+
+    SinkingCache(const SinkingCache &other) = delete;
+    SinkingCache operator=(const SinkingCache &other) = delete;
+    SinkingCache(SinkingCache &&other) = delete;
+    SinkingCache operator=(SinkingCache &&other) = delete;
+
+private:
+    struct Entry {
+        Value value;
+        // in Clock ticks, zero for never
+        int64_t expires;
+        size_t weight;
+        // the CLOCK reference bit, new entries get their first chance for free
+        mutable std::atomic<bool> referenced{true};
+
+        Entry(const Value &value, int64_t expires, size_t weight)
+            : value(value), expires(expires), weight(weight) {
+        }
+
+        Entry(const Entry &other)
+            : value(other.value),
+              expires(other.expires),
+              weight(other.weight),
+              referenced(other.referenced.load(std::memory_order_relaxed)) {
+        }
+
+        bool Expired(int64_t now) const {
+            return expires != 0 && expires <= now;
+        }
+    };
+
+    static int64_t Now();
+    // reads every stripe of the weight only when its estimate is too close to capacity to tell
+    bool OverCapacity() const;
+    void Evict();
+
+    // root slots an evicting thread takes from the hand at a time
+    static constexpr size_t kSweepStep = 8;
+    // the estimate of the weight may be off by capacity / kWeightTolerance
+    static constexpr size_t kWeightTolerance = 8;
+
+    SinkingTree<Key, Entry, Hasher, Policy> tree_;
+    size_t capacity_;
+    Weigher weigher_;
+    StripedCounter<16> weight_;
+    std::atomic<size_t> hand_{0};
+};
+
+// definitions
+
+template <class Key, class Value, class Hasher, class Policy>
+SinkingCache<Key, Value, Hasher, Policy>::SinkingCache(size_t capacity, Weigher weigher,
+                                                       Hasher hasher)
+    : tree_(weigher ? 2 : capacity, hasher),
+      capacity_(capacity),
+      weigher_(std::move(weigher)),
+      weight_(static_cast<int64_t>(std::max<size_t>(1, capacity / kWeightTolerance))) {
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+int64_t SinkingCache<Key, Value, Hasher, Policy>::Now() {
+    return Clock::now().time_since_epoch().count();
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingCache<Key, Value, Hasher, Policy>::Put(const Key &key, const Value &value,
+                                                   Clock::duration ttl) {
+    int64_t expires = ttl == Clock::duration::zero() ? 0 : Now() + ttl.count();
+    Entry entry(value, expires, weigher_ ? weigher_(key, value) : 1);
+    int64_t replaced_weight = -1;
+    bool inserted = tree_.Put(key, entry, [&replaced_weight](const Entry &old) {
+        replaced_weight = old.weight;
+    });
+    if (inserted) {
+        weight_.Add(entry.weight);
+    } else if (replaced_weight >= 0) {
+        weight_.Add(static_cast<int64_t>(entry.weight) - replaced_weight);
+    }
+    // otherwise a concurrent Put of the key overwrote this one at once, nothing changed
+    if (OverCapacity()) {
+        Evict();
+    }
+    return inserted;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+std::optional<Value> SinkingCache<Key, Value, Hasher, Policy>::Get(const Key &key) {
+    std::optional<Value> result;
+    bool expired = false;
+    tree_.Visit(key, [&result, &expired](const Entry &entry) {
+        if (entry.expires != 0 && entry.Expired(Now())) {
+            expired = true;
+            return;
+        }
+        // writes only the first time around, hot entries stay read-only
+        if (!entry.referenced.load(std::memory_order_relaxed)) {
+            entry.referenced.store(true, std::memory_order_relaxed);
+        }
+        result = entry.value;
+    });
+    if (expired) {
+        // unless it was replaced by a fresh one meanwhile
+        int64_t now = Now();
+        size_t weight = 0;
+        if (tree_.Erase(key, [now, &weight](const Entry &entry) {
+                weight = entry.weight;
+                return entry.Expired(now);
+            })) {
+            weight_.Add(-static_cast<int64_t>(weight));
+        }
+    }
+    return result;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingCache<Key, Value, Hasher, Policy>::Erase(const Key &key) {
+    size_t weight = 0;
+    if (tree_.Erase(key, [&weight](const Entry &entry) {
+            weight = entry.weight;
+            return true;
+        })) {
+        weight_.Add(-static_cast<int64_t>(weight));
+        return true;
+    }
+    return false;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingCache<Key, Value, Hasher, Policy>::OverCapacity() const {
+    auto capacity = static_cast<int64_t>(capacity_);
+    int64_t estimate = weight_.Estimate();
+    if (estimate + weight_.Tolerance() <= capacity) {
+        return false;
+    }
+    if (estimate - weight_.Tolerance() > capacity) {
+        return true;
+    }
+    return weight_.Load() > capacity;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingCache<Key, Value, Hasher, Policy>::Evict() {
+    int64_t now = Now();
+    auto pick = [now](const auto &, const Entry &entry) {
+        if (entry.Expired(now)) {
+            return true;
+        }
+        // second chance
+        if (entry.referenced.load(std::memory_order_relaxed)) {
+            entry.referenced.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    };
+    auto on_erase = [this](const auto &, const Entry &entry) {
+        weight_.Add(-static_cast<int64_t>(entry.weight));
+    };
+    // the hand clears every bit in one round at most, so this ends
+    while (OverCapacity() && !tree_.Empty()) {
+        size_t first = hand_.fetch_add(kSweepStep, std::memory_order_relaxed);
+        tree_.EraseIfInSlots(first, kSweepStep, pick, on_erase);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingCache<Key, Value, Hasher, Policy>::Size() const {
+    return tree_.Size();
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingCache<Key, Value, Hasher, Policy>::Weight() const {
+    return static_cast<size_t>(std::max<int64_t>(0, weight_.Load()));
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingCache<Key, Value, Hasher, Policy>::Capacity() const {
+    return capacity_;
+}
+}  // namespace sinking_tree
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// A counter split into cache-line sized stripes. Every thread updates its own stripe, so
+// concurrent updates do not bounce a single cache line between cores.
+// There is a stripe per hardware thread, rounded up to a power of two and capped at
+// MaxStripes. Each takes a cache line on the heap, so 4 KB per counter at most for the
+// default cap and 512 bytes on an 8-thread machine; the counter itself takes two more.
+// Given a tolerance, a stripe is moved into a shared total whenever it gets that far from
+// zero divided by the stripe count, so that Estimate() reads one word instead of every stripe.
+template <size_t MaxStripes = 64>
+class StripedCounter {
+    static_assert(std::has_single_bit(MaxStripes));
+
+public:
+    explicit StripedCounter(int64_t tolerance = 0)
+        : stripes_(std::make_unique<Stripe[]>(StripeCount())),
+          batch_(tolerance == 0 ? 0
+                                : std::max<int64_t>(
+                                      1, tolerance / static_cast<int64_t>(StripeCount()))) {
+    }
+
+    void Add(int64_t delta) {
+        Stripe &stripe = stripes_[StripeIndex()];
+        int64_t value = stripe.value.fetch_add(delta, std::memory_order_relaxed) + delta;
+        if (batch_ != 0 && (value >= batch_ || value <= -batch_)) {
+            // others may share the stripe, take whatever it holds by now
+            total_.value.fetch_add(stripe.value.exchange(0, std::memory_order_relaxed),
+                                   std::memory_order_relaxed);
+        }
+    }
+
+    // never blocks; exact once the updates are quiescent, a best-effort snapshot otherwise
+    int64_t Load() const {
+        int64_t sum = total_.value.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < StripeCount(); ++i) {
+            sum += stripes_[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // within Tolerance() of Load() once the updates are quiescent, given a tolerance at all
+    int64_t Estimate() const {
+        return total_.value.load(std::memory_order_relaxed);
+    }
+
+    int64_t Tolerance() const {
+        return batch_ == 0 ? 0 : (batch_ - 1) * static_cast<int64_t>(StripeCount());
+    }
+
+    void Reset() {
+        total_.value.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < StripeCount(); ++i) {
+            stripes_[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // the same for every counter of the type
+    static size_t StripeCount() {
+        static const size_t count = [] {
+            size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MaxStripes);
+            size_t count = 1;
+            while (count < threads) {
+                count *= 2;
+            }
+            return count;
+        }();
+        return count;
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<int64_t> value{0};
+    };
+
+    static size_t StripeIndex() {
+        static std::atomic<size_t> thread_counter{0};
+        static thread_local size_t index =
+            thread_counter.fetch_add(1, std::memory_order_relaxed) & (StripeCount() - 1);
+        return index;
+    }
+
+    std::unique_ptr<Stripe[]> stripes_;
+    Stripe total_;
+    // a stripe gets moved into the total once it is that far from zero, none if zero
+    int64_t batch_;
+};
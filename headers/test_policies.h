@@ -0,0 +1,34 @@
+#pragma once
+
+#include "kv_layouts.h"
+
+// Policies the tests and benchmarks compare the defaults against, see DefaultPolicy
+
+struct PlainKeys : sinking_tree::DefaultPolicy {
+    static constexpr bool kInlineKeys = false;
+};
+
+struct NoPacking : sinking_tree::DefaultPolicy {
+    static constexpr bool kPackedEntries = false;
+};
+
+struct OptimisticReads : sinking_tree::DefaultPolicy {
+    static constexpr bool kOptimisticReads = true;
+};
+
+struct NoCollapse : sinking_tree::DefaultPolicy {
+    static constexpr bool kCollapseCells = false;
+};
+
+struct RetryStatsPolicy : sinking_tree::DefaultPolicy {
+    static constexpr bool kRetryStats = true;
+};
+
+// counts the retries it lets through
+struct NoBackoff : RetryStatsPolicy {
+    static constexpr int kMaxBackoff = 0;
+};
+
+struct NoEntryCounts : sinking_tree::DefaultPolicy {
+    static constexpr bool kCountEntries = false;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Objects of T are allocated in chunks which are not freed while the pool is in use. A released
+// object goes back to a free list as is, without being destroyed, and is handed out again
+// later. So a stale pointer always points to a live T, which readers validating their copies by
+// a version stored inside T rely on, see OptimisticKV.
+// The pool is shared by all users of T, each holds a Lease. Its memory only grows to the peak
+// number of objects in use at once, and goes back to the system when the last lease is gone.
+// Every thread keeps a cache of free objects and trades whole batches with the others.
+template <class T, size_t BatchSize = 64>
+class TypeStablePool {
+public:
+    // every object must have been released before the last lease goes
+    class Lease {
+    public:
+        Lease() {
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            ++shared.leases;
+        }
+
+        ~Lease() {
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            if (--shared.leases == 0) {
+                FreeChunks(shared);
+            }
+        }
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+    };
+
+    static T *Acquire() {
+        std::vector<T *> &cache = LocalCache();
+        if (cache.empty()) {
+            Refill(cache);
+        }
+        T *object = cache.back();
+        cache.pop_back();
+        return object;
+    }
+
+    static void Release(T *object) {
+        std::vector<T *> &cache = LocalCache();
+        cache.push_back(object);
+        if (cache.size() >= 2 * BatchSize) {
+            std::vector<T *> batch(cache.end() - BatchSize, cache.end());
+            cache.resize(cache.size() - BatchSize);
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            shared.batches.push_back(std::move(batch));
+        }
+    }
+
+private:
+    struct Shared {
+        std::mutex mutex;
+        std::vector<std::vector<T *>> batches;
+        std::vector<T *> chunks;
+        size_t leases{0};
+    };
+
+    // a thread hands its free objects over to the others when it exits
+    struct Cache {
+        std::vector<T *> objects;
+        // of the chunks the objects come from
+        uint64_t generation{0};
+
+        ~Cache() {
+            if (objects.empty()) {
+                return;
+            }
+            Shared &shared = GetShared();
+            std::lock_guard lock(shared.mutex);
+            if (generation == generation_.load(std::memory_order_relaxed)) {
+                shared.batches.push_back(std::move(objects));
+            }
+        }
+    };
+
+    // intentionally never destroyed, the objects must outlive every user
+    static Shared &GetShared() {
+        static Shared *shared = new Shared;
+        return *shared;
+    }
+
+    static std::vector<T *> &LocalCache() {
+        static thread_local Cache cache;
+        // the chunks were freed since the cache was filled, by the users this thread served
+        uint64_t generation = generation_.load(std::memory_order_relaxed);
+        if (cache.generation != generation) {
+            cache.objects.clear();
+            cache.generation = generation;
+        }
+        return cache.objects;
+    }
+
+    static void Refill(std::vector<T *> &cache) {
+        Shared &shared = GetShared();
+        {
+            std::lock_guard lock(shared.mutex);
+            if (!shared.batches.empty()) {
+                cache = std::move(shared.batches.back());
+                shared.batches.pop_back();
+                return;
+            }
+        }
+        T *chunk = new T[BatchSize];
+        {
+            std::lock_guard lock(shared.mutex);
+            shared.chunks.push_back(chunk);
+        }
+        for (size_t i = 0; i < BatchSize; ++i) {
+            cache.push_back(chunk + i);
+        }
+    }
+
+    // under the mutex; the cache of every thread is dropped the next time it is used
+    static void FreeChunks(Shared &shared) {
+        for (T *chunk : shared.chunks) {
+            delete[] chunk;
+        }
+        shared.chunks.clear();
+        shared.batches.clear();
+        generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static inline std::atomic<uint64_t> generation_{0};
+};
@@ -1,11 +1,25 @@
+#pragma once
+
+#include "backoff.h"
 #include "hazard_ptr.h"
 #include "hashers.h"
+#include "kv_layouts.h"
+#include "parallel.h"
+#include "striped_counter.h"
+#include "type_stable_pool.h"
 
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <functional>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace sinking_tree {
 
@@ -23,7 +37,20 @@ inline uintptr_t bits(void *ptr) {
 }
 
 inline uintptr_t filter_ptr(void *ptr) {
-    return bits(ptr) & ~static_cast<uintptr_t>(1);
+    return bits(ptr) & ~static_cast<uintptr_t>(3);
+}
+
+// a slot of a cell being collapsed, it never changes again
+inline bool IsFrozen(void *ptr) {
+    return bits(ptr) & 2;
+}
+
+inline void *Freeze(void *ptr) {
+    return reinterpret_cast<void *>(bits(ptr) | 2);
+}
+
+inline void *Thaw(void *ptr) {
+    return reinterpret_cast<void *>(bits(ptr) & ~static_cast<uintptr_t>(2));
 }
 }  // namespace
 
@@ -34,7 +61,55 @@ using namespace hashers;
 enum class AcceptorState { kEmpty, kKeyValue, kCell };
 enum class InjectorState { kEmpty, kKeyValue, kCell };
 
-template <class Key, class Value, class Hasher = DefaultHasher<Key>>
+// Hands out the bits of the hash of a key one level at a time, rehashing with the next seed
+// once they run out.
+template <class KeyView, class Hasher>
+class TreeTraverser {
+public:
+    TreeTraverser(KeyView key, Hasher hasher)
+        : key_ref_(key), hasher_(hasher), hash_(hasher_(key, 0)), first_hash_(hash_){};
+    TreeTraverser(KeyView key, Hasher hasher, HashType first_hash)
+        : key_ref_(key), hasher_(hasher), hash_(first_hash), first_hash_(first_hash){};
+
+    int Advance(int bit_count = 1) {
+        while (bit_count > bits_alive_) {
+            bits_consumed_ += bits_alive_;
+            bit_count -= bits_alive_;
+            hash_ = hasher_(key_ref_, bits_consumed_ / (sizeof(HashType) * 8));
+            bits_alive_ = 8 * sizeof(HashType);
+        }
+        int index = hash_ & n_bit_mask(bit_count);
+        hash_ >>= bit_count;
+        bits_alive_ -= bit_count;
+        bits_consumed_ += bit_count;
+        return index;
+    }
+
+    int BitsConsumed() const {
+        return bits_consumed_;
+    }
+
+    void Reset() {
+        hash_ = first_hash_;
+        bits_consumed_ = 0;
+        bits_alive_ = 8 * sizeof(HashType);
+    }
+
+    HashType FirstHash() const {
+        return first_hash_;
+    }
+
+private:
+    KeyView key_ref_;
+    Hasher hasher_;
+    HashType hash_;
+    HashType first_hash_;
+    int bits_consumed_{0};
+    uint8_t bits_alive_{8 * sizeof(HashType)};
+};
+
+template <class Key, class Value, class Hasher = DefaultHasher<Key>,
+          class Policy = DefaultPolicy>
 class SinkingTree {
     struct Root {
         size_t bit_count;
@@ -44,51 +119,209 @@ class SinkingTree {
     struct alignas(16) Cell {
         std::atomic<void *> lhs{};
         std::atomic<void *> rhs{};
-        // the lowest bit is 0 - KV*
+        // the lowest bit is 0 - an entry (see kv_layouts.h)
         // the lowest bit is 1 - Cell*
-        ~Cell();
+        // the second bit is 1 - the slot is frozen, see FinishCollapse()
+    };
+
+    // see kv_layouts.h
+    using KV = typename KVLayout<Key, Value, Hasher, Policy>::Type;
+    using KeyView = typename KV::KeyView;
+
+    using TreeTraverser = sinking_tree::TreeTraverser<KeyView, Hasher>;
+
+    static constexpr int kMaxSolidity_ = 8 * sizeof(HashType);
+
+    // Get copies entries of such a layout out without protecting anything, see OptimisticGet()
+    static constexpr bool kOptimisticReads =
+        requires(std::atomic<void *> &slot, KeyView key, std::optional<Value> &out) {
+            KV::TryRead(nullptr, slot, key, HashType{}, out);
+        };
+    // those reads walk cells unprotected, so cells never go while their Trie is in use then
+    static constexpr bool kCollapse = Policy::kCollapseCells && !kOptimisticReads;
+
+    // Collapses and the barriers against them, for the root slots whose number has the
+    // stripe number in its lowest bits. Sinking keeps those bits, so the cells under a root
+    // slot stay in its stripe, whatever the root the slot was taken from.
+    struct CollapseStripe {
+        std::atomic<size_t> collapsing{0};
+        std::atomic<size_t> blockers{0};
+    };
+    static constexpr int kCollapseStripeBits = 6;
+    static constexpr size_t kCollapseStripes = size_t{1} << kCollapseStripeBits;
+
+    struct Trie;
+
+    // Where the Tries of a map reading optimistically go when freed, along with their roots.
+    // Stale readers may still walk them, so they are reused but never given back while the
+    // map lives, and hold as much as the map ever used at once. Cells and entries go back
+    // to pools of their own.
+    struct Recycler {
+        std::mutex mutex;
+        std::vector<Trie *> tries;
+        // by bit count
+        std::array<std::vector<Root *>, kMaxSolidity_ + 1> roots;
+        typename TypeStablePool<Cell>::Lease cell_lease;
+
+        ~Recycler();
+    };
+    struct NoRecycler {};
+    // stands in for the entry count when none is kept
+    struct NoCounter {
+        void Reset() {
+        }
+
+        int64_t Load() const {
+            return 0;
+        }
     };
 
-    // alignment property ensures last pointer bit for this type is always zero,
-    // even if K or V is an dataless type
-    // making a set(V = void) with a single-bit key possible
-    struct alignas(std::max(2UL, alignof(std::pair<Key, Value>))) KV {
-        Key key;
-        Value value;
+    // Everything Clear() swaps out at once. Cells live exactly as long as their Trie.
+    struct Trie {
+        std::atomic<Root *> root;
+        std::array<Root *, kMaxSolidity_> old_roots{};
+        // cells per level, the level of a cell being the number of bits that lead to it
+        std::atomic<size_t> cell_count[kMaxSolidity_]{};
+        [[no_unique_address]] std::conditional_t<Policy::kCountEntries, StripedCounter<>,
+                                                  NoCounter> size;
+        // Collapses run only while nobody walks their cells without protecting them (Sink and
+        // sweeps), see CollapseBarrier. One thread sinks at a time.
+        std::array<CollapseStripe, kCollapseStripes> collapse_stripes;
+        // the ones keeping collapses off every stripe
+        std::atomic<size_t> collapse_blockers{0};
+        std::atomic<bool> sinking{false};
+        size_t destruction_threads{1};
+        // set when the tree is to be freed off the thread that reclaims the Trie
+        parallel::BackgroundWorker *background{nullptr};
+        // odd while the Trie waits in its recycler, see OptimisticGet()
+        std::atomic<uint64_t> generation{0};
+        // none if the Trie is not to be reused
+        Recycler *recycler;
+
+        Trie(size_t bit_count, Recycler *recycler);
+        // frees the tree, then the Trie itself unless its recycler takes it
+        static void operator delete(Trie *, std::destroying_delete_t);
+        // makes a recycled Trie as good as new
+        void Reset(size_t bit_count);
+        static void Deallocate(Trie *);
     };
 
-    class TreeTraverser {
+    // Keeps collapses off a Trie, or off the cells under one root slot only, and waits for the
+    // running ones to finish, yielding meanwhile. Collapses give up while one stands, so hold it
+    // for short stretches of work only.
+    class CollapseBarrier {
     public:
-        TreeTraverser(const Key &key, Hasher hasher)
-            : key_ref_(key), hasher_(hasher), hash_(hasher_(key, 0)){};
-
-        int Advance(int bit_count = 1) {
-            while (bit_count > bits_alive_) {
-                bits_consumed_ += bits_alive_;
-                bit_count -= bits_alive_;
-                hash_ = hasher_(key_ref_, bits_consumed_ / (sizeof(HashType) * 8));
-                bits_alive_ = 8 * sizeof(HashType);
+        explicit CollapseBarrier(Trie *trie) : CollapseBarrier(trie, nullptr) {
+        }
+
+        // a slot of a narrow root spans several stripes, the barrier takes them all then
+        CollapseBarrier(Trie *trie, const Root *root, size_t slot)
+            : CollapseBarrier(trie, root->bit_count < kCollapseStripeBits
+                                        ? nullptr
+                                        : &trie->collapse_stripes[slot % kCollapseStripes]) {
+        }
+
+        ~CollapseBarrier() {
+            blockers_->fetch_sub(1, std::memory_order_release);
+        }
+
+        CollapseBarrier(const CollapseBarrier &) = delete;
+        CollapseBarrier &operator=(const CollapseBarrier &) = delete;
+
+    private:
+        // all stripes for none
+        CollapseBarrier(Trie *trie, CollapseStripe *stripe)
+            : blockers_(stripe ? &stripe->blockers : &trie->collapse_blockers) {
+            blockers_->fetch_add(1, std::memory_order_seq_cst);
+            if (stripe != nullptr) {
+                Wait(*stripe);
+                return;
+            }
+            for (const CollapseStripe &each : trie->collapse_stripes) {
+                Wait(each);
+            }
+        }
+
+        static void Wait(const CollapseStripe &stripe) {
+            while (stripe.collapsing.load(std::memory_order_seq_cst) != 0) {
+                std::this_thread::yield();
             }
-            int index = hash_ & n_bit_mask(bit_count);
-            hash_ >>= bit_count;
-            bits_alive_ -= bit_count;
-            bits_consumed_ += bit_count;
-            return index;
         }
 
-        int BitsConsumed() const {
-            return bits_consumed_;
+        std::atomic<size_t> *blockers_;
+    };
+
+    // Where a traversal stands: the slot it is at, the cell that slot belongs to (none for the
+    // root slots) and the slot holding that cell.
+    struct Cursor {
+        std::atomic<void *> *slot;
+        Cell *cell{nullptr};
+        std::atomic<void *> *parent{nullptr};
+        int level{0};
+        // cells protected so far, they take turns in the hazard slots: the cell and its parent
+        // must stay protected while the next one is tried, the parent holds the slot to
+        // replace the cell in if it turns out frozen
+        int hops{0};
+    };
+
+    static constexpr size_t kCellHazards = 3;
+    using CellHazard = Hazard<Cell, kCellHazards>;
+    // Sweeps hold their Trie and the entry passed to the callback in hazard slots of their
+    // own, so that a callback may Get, Put or Erase on the same map. It must not sweep the map
+    // again though, the nested sweep would take the slots over, debug builds assert that.
+    static constexpr size_t kSweepHazard = 1;
+    using TrieHazard = Hazard<Trie, 2>;
+    using EntryHazard = Hazard<KV, 2>;
+
+    // keeps the current Trie alive for the duration of one operation
+    class TrieGuard {
+    public:
+        explicit TrieGuard(const SinkingTree &tree, size_t index = 0)
+            : mutator_(tree.trie_manager_.MakeMutator()),
+              index_(index),
+              trie_(mutator_.Protect(index, tree.trie_)) {
+        }
+
+        ~TrieGuard() {
+            mutator_.Release(index_);
+        }
+
+        Trie *Get() const {
+            return trie_;
         }
 
     private:
-        const Key &key_ref_;
-        Hasher hasher_;
-        HashType hash_;
-        int bits_consumed_{0};
-        uint8_t bits_alive_{8 * sizeof(HashType)};
+        typename TrieHazard::Mutator mutator_;
+        size_t index_;
+        Trie *trie_;
     };
 
-    static constexpr int kMaxSolidity_ = 8 * sizeof(HashType);
+    // marks the sweeps running on the calling thread, see kSweepHazard
+    class SweepMark {
+    public:
+        explicit SweepMark(const SinkingTree *tree) : tree_(tree), outer_(Innermost()) {
+            for (const SweepMark *mark = outer_; mark != nullptr; mark = mark->outer_) {
+                assert(mark->tree_ != tree && "a sweep callback must not sweep the same map");
+            }
+            Innermost() = this;
+        }
+
+        ~SweepMark() {
+            Innermost() = outer_;
+        }
+
+        SweepMark(const SweepMark &) = delete;
+        SweepMark &operator=(const SweepMark &) = delete;
+
+    private:
+        static const SweepMark *&Innermost() {
+            static thread_local const SweepMark *innermost = nullptr;
+            return innermost;
+        }
+
+        const SinkingTree *tree_;
+        const SweepMark *outer_;
+    };
 
 public:
     SinkingTree(size_t capacity = 2, Hasher hasher = Hasher());
@@ -98,6 +331,84 @@ public:
     std::optional<Value> Get(const Key &key);
     bool Erase(const Key &key);
 
+    // Hooks for wrappers keeping their own state in the values, such as SinkingCache.
+    // Put calls on_replace(old_value) if it replaced an entry.
+    template <class OnReplace>
+    bool Put(const Key &key, const Value &value, OnReplace on_replace);
+    // calls fn(value) on the entry in place of copying the value out, false if there is none;
+    // fn must not call into the map
+    template <class Function>
+    bool Visit(const Key &key, Function fn);
+    // erases the entry only if pred(value) holds for it
+    template <class Predicate>
+    bool Erase(const Key &key, Predicate pred);
+
+    // never blocks; exact while no modifications run concurrently, approximate otherwise;
+    // needs Policy::kCountEntries
+    size_t Size() const;
+    bool Empty() const;
+    // walks the whole tree, must not run concurrently with modifications
+    size_t ExactSize() const;
+
+    struct Shape {
+        size_t cells{0};
+        // in cells passed below the root
+        size_t max_depth{0};
+        double average_depth{0};
+    };
+    // walks the whole tree, must not run concurrently with modifications
+    Shape GetShape() const;
+
+    // Both sweep the root slots on `threads` threads and may run alongside other operations.
+    // Entries inserted, replaced or erased during the sweep may or may not be seen.
+    // fn(key, value) and pred(key, value) are called concurrently from different threads,
+    // inline string keys are passed as string views. They may Get, Put and Erase on this map,
+    // but not sweep it.
+    template <class Function>
+    void ParallelForEach(Function fn, size_t threads = 1);
+    // returns the number of erased entries
+    template <class Predicate>
+    size_t EraseIf(Predicate pred, size_t threads = 1);
+    // Same as EraseIf on the calling thread, but only over `count` root slots from `first`
+    // on, slot numbers taken modulo the root size. Lets a sweep go round the tree piece by
+    // piece. Calls on_erase(key, value) for every entry erased.
+    template <class Predicate, class OnErase>
+    size_t EraseIfInSlots(size_t first, size_t count, Predicate pred, OnErase on_erase);
+
+    // Contention met by Put and Erase, collected only with Policy::kRetryStats. The counts
+    // are kept per root slot, folded into a fixed number of buckets by the lowest hash bits.
+    struct RetryStats {
+        // failed CASes
+        uint64_t retries{0};
+        // Puts that gave way to a concurrent Put of the same key
+        uint64_t eliminated{0};
+        std::vector<uint64_t> retries_by_slot;
+    };
+    RetryStats GetRetryStats() const;
+    void ResetRetryStats();
+
+    // Both move subtrees between trees of the same shape, so the hashers must hash alike.
+    // Neither may run concurrently with any other operation on either tree.
+    // Moves every entry of other here, as if by Put: the entries of other win on equal keys.
+    // Root slots empty on one side are grafted whole, only the ones filled on both sides are
+    // merged cell by cell.
+    void Merge(SinkingTree &other);
+    // Moves to other every entry whose lowest prefix_bits (< 64) bits of hasher(key, 0)
+    // pred(bits) accepts. Subtrees that deep are decided and moved whole, without rehashing
+    // or copying an entry, but are still walked to count their entries and cells for both
+    // trees, so a Split takes time linear in what it moves. Returns the number of moved
+    // entries.
+    template <class Predicate>
+    size_t Split(SinkingTree &other, int prefix_bits, Predicate pred);
+
+    // the destructor frees the tree on that many threads
+    void SetDestructionThreads(size_t threads);
+
+    // Atomically replaces the contents with an empty tree, concurrent operations see either
+    // all of the old entries or none. The old tree is freed once no operation uses it,
+    // on a background thread if asked to.
+    void Clear(bool free_in_background = false);
+
     SinkingTree(const SinkingTree &other) = delete;
     SinkingTree operator=(const SinkingTree &other) = delete;
     SinkingTree(SinkingTree &&other) = delete;
@@ -106,49 +417,298 @@ public:
     void CleanupHazard();
 
 private:
-    void Sink(int);
+    void Sink(Trie *);
+    // counts a failed CAS and waits before the retry, always true
+    bool BackOff(HashType first_hash, Backoff<Policy::kMaxBackoff> &);
+    void CountElimination(HashType first_hash);
+    static bool SinkDue(Trie *);
+    static bool SinkOnce(Trie *);
+    static Cursor Start(Root *, TreeTraverser &);
+    // moves the cursor into the cell ptr read from its slot, false with ptr reloaded if the
+    // slot changed before the cell got protected
+    static bool Descend(typename CellHazard::Mutator &, Root *, TreeTraverser &, Cursor &,
+                        void *&ptr);
+    // the cursor ran into a frozen slot: finishes that collapse and starts over
+    static Root *HelpAndRestart(Trie *, typename CellHazard::Mutator &, TreeTraverser &,
+                                Cursor &);
+    static bool FinishCollapse(Trie *, typename CellHazard::Mutator &, std::atomic<void *> &parent,
+                               Cell *, int level);
+    // false if a barrier held it off
+    bool CollapsePath(Trie *, typename CellHazard::Mutator &, const Key &);
+    // collapses after the keys of erased entries, waiting out barriers, and empties keys
+    void CollapsePaths(Trie *, typename CellHazard::Mutator &, std::vector<Key> &keys);
     AcceptorState DeliberateState(void *);
-    void FreeRoot(Root *);
+    TreeTraverser Retrace(const void *entry) const;
+    // loads a slot, protecting the node if the entry in it is one
+    static void *LoadEntry(typename EntryHazard::Mutator &, std::atomic<void *> &,
+                           size_t index = 0);
+    static void RetireEntry(typename EntryHazard::Mutator &, void *entry);
+    // updates the entry count, if kept
+    static void AddSize(Trie *, int64_t delta);
+    static void FreeTree(Root *, const std::array<Root *, kMaxSolidity_> &, size_t threads,
+                         Recycler *);
+    static void FreeRoot(Root *, Recycler *, size_t threads = 1);
+    static void FreeSlot(void *);
+    // The slots of the root are left as they were. Stores to a root, cell or entry that
+    // may be reused must be release stores, see Trie::delete.
+    static Root *NewRoot(size_t bit_count, Recycler *);
+    static void DropRoot(Root *, Recycler *);
+    static Cell *NewCell();
+    static void FreeCell(Cell *);
+    Trie *NewTrie();
+    std::optional<Value> OptimisticGet(const Key &key);
+    static size_t CountEntries(void *);
+    static void MeasureShape(void *, size_t depth, Shape &, size_t &entries);
+    // calls visitor(slot, kv) for every KV under slot, with kv protected by the mutator
+    template <class Visitor>
+    static void VisitSlot(typename EntryHazard::Mutator &, std::atomic<void *> &, Visitor &);
+    // calls visitor(trie, slot, kv, erased_keys) for every KV, the keys a visitor adds to
+    // erased_keys are collapsed after once the barrier of their root slot is gone
+    template <class Visitor>
+    void SweepSlots(Visitor, size_t threads);
+
+    // what a graft changes in the counts of a Trie
+    struct GraftStats {
+        int64_t entries{0};
+        std::array<int64_t, kMaxSolidity_> cells{};
+
+        void CountCell(int level, int64_t delta) {
+            if (level <= kMaxSolidity_) {
+                cells[level - 1] += delta;
+            }
+        }
+    };
+    static void ApplyStats(Trie *, const GraftStats &, int sign);
+    // puts subtree src, which hangs below hash prefix `prefix` of `level` bits, into the tree
+    void PlaceSubtree(Root *, void *src, HashType prefix, int level, GraftStats &);
+    void GraftSlot(std::atomic<void *> &dst, void *src, int level, GraftStats &);
+    // on an equal key the entry replaces the one in place if it wins, or is freed otherwise
+    void InsertEntry(std::atomic<void *> &dst, void *entry, int level, bool wins, GraftStats &);
+    // turns the slot into a cell if it is not one yet
+    Cell *MakeCell(std::atomic<void *> &slot, int level, GraftStats &);
+    template <class Predicate>
+    void SplitSlot(std::atomic<void *> &slot, HashType prefix, int level, int prefix_bits,
+                   Predicate &pred, SinkingTree &other, Root *other_root, GraftStats &taken,
+                   GraftStats &placed);
+    // O(n) in the subtree, no counts are kept per subtree to spare it
+    static void CountSubtree(void *, int level, GraftStats &);
 
-    std::atomic<Root *> root_;
+    std::atomic<Trie *> trie_;
     Hasher hasher_;
-    std::array<Root *, kMaxSolidity_> old_roots_{};
-    std::atomic<size_t> cell_count_[kMaxSolidity_]{};
+    size_t initial_bit_count_;
+    size_t destruction_threads_{1};
 
-    Hazard<KV>::Manager manager_;
+    struct alignas(64) RetryBucket {
+        std::atomic<uint64_t> retries{0};
+        std::atomic<uint64_t> eliminated{0};
+    };
+    static constexpr size_t kRetryBuckets = 256;
+    std::array<RetryBucket, Policy::kRetryStats ? kRetryBuckets : 0> retry_buckets_;
+
+    // keeps pooled nodes alive until the managers below have reclaimed the last of them
+    [[no_unique_address]] typename LeaseOf<KV>::Type lease_;
+    [[no_unique_address]] std::conditional_t<kOptimisticReads, Recycler, NoRecycler> recycler_;
+    // declared first to outlive the Tries the managers below may still reclaim
+    parallel::BackgroundWorker background_;
+    mutable typename TrieHazard::Manager trie_manager_;
+    typename EntryHazard::Manager manager_;
+    typename CellHazard::Manager cell_manager_;
 };
 
 // definitions
 
-template <class Key, class Value, class Hasher>
-SinkingTree<Key, Value, Hasher>::SinkingTree(size_t capacity, Hasher hasher) : hasher_(hasher) {
+template <class Key, class Value, class Hasher, class Policy>
+SinkingTree<Key, Value, Hasher, Policy>::Trie::Trie(size_t bit_count, Recycler *recycler)
+    : recycler(recycler) {
+    Root *r_ptr = NewRoot(bit_count, recycler);
+    for (size_t i = 0; i < power(bit_count); ++i) {
+        r_ptr->ptrs[i].store(nullptr, std::memory_order_release);
+    }
+    root.store(r_ptr, std::memory_order_release);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Trie::operator delete(Trie *trie,
+                                                                    std::destroying_delete_t) {
+    Recycler *recycler = trie->recycler;
+    if (recycler != nullptr) {
+        // Stale readers see the Trie go before anything of it is reused: whatever they read
+        // of the reused memory is written by a release store after this.
+        trie->generation.fetch_add(1, std::memory_order_relaxed);
+    }
+    Root *r_ptr = trie->root.load(std::memory_order_relaxed);
+    if (trie->background != nullptr) {
+        trie->background->Post(
+            [r_ptr, old = trie->old_roots, recycler] { FreeTree(r_ptr, old, 1, recycler); });
+    } else {
+        FreeTree(r_ptr, trie->old_roots, trie->destruction_threads, recycler);
+    }
+    if (recycler != nullptr) {
+        std::lock_guard lock(recycler->mutex);
+        recycler->tries.push_back(trie);
+    } else {
+        Deallocate(trie);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Trie::Reset(size_t bit_count) {
+    Root *r_ptr = NewRoot(bit_count, recycler);
+    for (size_t i = 0; i < power(bit_count); ++i) {
+        r_ptr->ptrs[i].store(nullptr, std::memory_order_release);
+    }
+    root.store(r_ptr, std::memory_order_release);
+    old_roots.fill(nullptr);
+    for (auto &count : cell_count) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    size.Reset();
+    destruction_threads = 1;
+    background = nullptr;
+    // even again, readers seeing that see the new root as well
+    generation.fetch_add(1, std::memory_order_release);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Trie::Deallocate(Trie *trie) {
+    trie->~Trie();
+    if constexpr (alignof(Trie) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        ::operator delete(trie, std::align_val_t{alignof(Trie)});
+    } else {
+        ::operator delete(trie);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+SinkingTree<Key, Value, Hasher, Policy>::Recycler::~Recycler() {
+    // the trees of the Tries here are freed already
+    for (Trie *trie : tries) {
+        Trie::Deallocate(trie);
+    }
+    for (auto &free_roots : roots) {
+        for (Root *r_ptr : free_roots) {
+            free(r_ptr);
+        }
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::NewTrie() -> Trie * {
+    if constexpr (kOptimisticReads) {
+        Trie *trie = nullptr;
+        {
+            std::lock_guard lock(recycler_.mutex);
+            if (!recycler_.tries.empty()) {
+                trie = recycler_.tries.back();
+                recycler_.tries.pop_back();
+            }
+        }
+        if (trie != nullptr) {
+            trie->Reset(initial_bit_count_);
+            return trie;
+        }
+        return new Trie(initial_bit_count_, &recycler_);
+    } else {
+        return new Trie(initial_bit_count_, nullptr);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::NewRoot(size_t bit_count, Recycler *recycler)
+    -> Root * {
+    if (recycler != nullptr) {
+        Root *r_ptr = nullptr;
+        {
+            std::lock_guard lock(recycler->mutex);
+            auto &free_roots = recycler->roots[bit_count];
+            if (!free_roots.empty()) {
+                r_ptr = free_roots.back();
+                free_roots.pop_back();
+            }
+        }
+        if (r_ptr != nullptr) {
+            return r_ptr;
+        }
+    }
+    Root *r_ptr = reinterpret_cast<Root *>(
+        malloc(sizeof(Root) + sizeof(std::atomic<void *>) * power(bit_count)));
+    r_ptr->bit_count = bit_count;
+    return r_ptr;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::DropRoot(Root *r_ptr, Recycler *recycler) {
+    if (recycler != nullptr) {
+        std::lock_guard lock(recycler->mutex);
+        recycler->roots[r_ptr->bit_count].push_back(r_ptr);
+    } else {
+        free(r_ptr);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::NewCell() -> Cell * {
+    if constexpr (kOptimisticReads) {
+        Cell *cell = TypeStablePool<Cell>::Acquire();
+        cell->lhs.store(nullptr, std::memory_order_release);
+        cell->rhs.store(nullptr, std::memory_order_release);
+        return cell;
+    } else {
+        return new Cell;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::FreeCell(Cell *cell) {
+    if constexpr (kOptimisticReads) {
+        if (cell != nullptr) {
+            TypeStablePool<Cell>::Release(cell);
+        }
+    } else {
+        delete cell;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+SinkingTree<Key, Value, Hasher, Policy>::SinkingTree(size_t capacity, Hasher hasher)
+    : hasher_(hasher) {
     size_t bit_count = 1;
     size_t root_size = 1 << bit_count;
     while (root_size < capacity) {
         root_size <<= 1;
         bit_count++;
     }
-    Root *r_ptr =
-        reinterpret_cast<Root *>(malloc(sizeof(Root) + sizeof(std::atomic<void *>) * root_size));
-    root_.store(r_ptr, std::memory_order_release);
-    r_ptr->bit_count = bit_count;
-    for (size_t i = 0; i < root_size; ++i) {
-        r_ptr->ptrs[i] = nullptr;
-    }
+    initial_bit_count_ = bit_count;
+    trie_.store(NewTrie(), std::memory_order_release);
 }
 
-template <class Key, class Value, class Hasher>
-bool SinkingTree<Key, Value, Hasher>::Put(const Key &key, const Value &value) {
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::Put(const Key &key, const Value &value) {
+    return Put(key, value, [](const Value &) {});
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class OnReplace>
+bool SinkingTree<Key, Value, Hasher, Policy>::Put(const Key &key, const Value &value,
+                                                  OnReplace on_replace) {
+    TrieGuard guard(*this);
+    Trie *trie = guard.Get();
     auto mutator = manager_.MakeMutator();
+    auto cells = cell_manager_.MakeMutator();
+    Backoff<Policy::kMaxBackoff> backoff;
 
     TreeTraverser traverser(key, hasher_);
-    Root *root = root_.load(std::memory_order_acquire);
-    std::atomic<void *> *ptr2atomic = &root->ptrs[traverser.Advance(root->bit_count)];
+    Root *root = trie->root.load(std::memory_order_acquire);
+    Cursor cursor = Start(root, traverser);
 
-    void *desired = new KV{key, value};
-    void *expected = ptr2atomic->load(std::memory_order_acquire);
+    void *desired = KV::Make(key, value, traverser.FirstHash());
+    void *expected = cursor.slot->load(std::memory_order_acquire);
 
     int migration_index = 0;
+    // a split that lost its CAS keeps the cell for the next attempt
+    Cell *spare = nullptr;
+    // the entry of the same key this Put tried to replace last
+    void *replacing = nullptr;
 
     void *second_extra = nullptr;
     InjectorState inj = InjectorState::kKeyValue;
@@ -157,35 +717,48 @@ bool SinkingTree<Key, Value, Hasher>::Put(const Key &key, const Value &value) {
         deliberate:
             auto acc = DeliberateState(expected);
             if (inj == InjectorState::kCell) {
-                Cell *discard = reinterpret_cast<Cell *>(filter_ptr(desired));
-                reinterpret_cast<std::atomic<void *> *>(discard)[migration_index].store(
-                    nullptr, std::memory_order_relaxed);
-                delete discard;
+                spare = reinterpret_cast<Cell *>(filter_ptr(desired));
+                reinterpret_cast<std::atomic<void *> *>(spare)[migration_index].store(
+                    nullptr, std::memory_order_release);
                 desired = second_extra;
                 second_extra = nullptr;
                 inj = InjectorState::kKeyValue;
             }
+            if (IsFrozen(expected)) {
+                root = HelpAndRestart(trie, cells, traverser, cursor);
+                expected = cursor.slot->load(std::memory_order_acquire);
+                goto deliberate;
+            }
             if (acc == AcceptorState::kKeyValue) {
-                void *ptr = mutator.Protect(0, *ptr2atomic);
-                if (bits(ptr) & 1) {
-                    ptr2atomic = &reinterpret_cast<std::atomic<void *> *>(
-                        filter_ptr(ptr))[traverser.Advance()];
-                    expected = ptr2atomic->load(std::memory_order_acquire);
+                void *ptr = LoadEntry(mutator, *cursor.slot);
+                if (ptr == nullptr) {
+                    // erased in the meantime
+                    expected = nullptr;
+                    continue;
+                } else if (IsFrozen(ptr) || (bits(ptr) & 1)) {
+                    expected = ptr;
                     goto deliberate;
                 } else {
-                    KV *acc_ptr = reinterpret_cast<KV *>(ptr);
-                    KV *inj_ptr = reinterpret_cast<KV *>(desired);
-                    if (acc_ptr->key == inj_ptr->key) {
+                    if (KV::Matches(ptr, key, traverser.FirstHash())) {
+                        if (replacing != nullptr && ptr != replacing) {
+                            // A concurrent Put of the same key replaced the entry first. This
+                            // one takes effect right before it and is overwritten at once.
+                            CountElimination(traverser.FirstHash());
+                            KV::Free(desired);
+                            FreeCell(spare);
+                            return false;
+                        }
+                        replacing = ptr;
                         expected = ptr;
                         continue;
                     }
                     // no Release() intended
-                    Cell *new_cell = new Cell;
-                    TreeTraverser repath(acc_ptr->key, hasher_);
+                    Cell *new_cell = spare != nullptr ? std::exchange(spare, nullptr) : NewCell();
+                    TreeTraverser repath = Retrace(ptr);
                     repath.Advance(traverser.BitsConsumed());
                     migration_index = repath.Advance();
                     reinterpret_cast<std::atomic<void *> *>(new_cell)[migration_index].store(
-                        ptr, std::memory_order_relaxed);
+                        ptr, std::memory_order_release);
 
                     second_extra = desired;
                     desired = reinterpret_cast<void *>(bits(new_cell) | 1);
@@ -193,82 +766,190 @@ bool SinkingTree<Key, Value, Hasher>::Put(const Key &key, const Value &value) {
                     inj = InjectorState::kCell;
                 }
             } else if (acc == AcceptorState::kCell) {
-                ptr2atomic = &reinterpret_cast<std::atomic<void *> *>(
-                    filter_ptr(expected))[traverser.Advance()];
-                expected = ptr2atomic->load(std::memory_order_acquire);
+                Descend(cells, root, traverser, cursor, expected);
                 goto deliberate;
             } else {
                 // inaction intended
             }
-        } while (!ptr2atomic->compare_exchange_weak(expected, desired, std::memory_order_acq_rel));
+        } while (
+            !cursor.slot->compare_exchange_weak(expected, desired, std::memory_order_acq_rel) &&
+            BackOff(traverser.FirstHash(), backoff));
 
         if (second_extra == nullptr) {
             break;
         } else {
             int solidity = traverser.BitsConsumed();
             if (solidity <= kMaxSolidity_) {
-                auto before = cell_count_[solidity - 1].fetch_add(1);
+                auto before = trie->cell_count[solidity - 1].fetch_add(1);
                 if (solidity > 1 && before + 1 == power(solidity) &&
                     traverser.BitsConsumed() - root->bit_count > 1) {
-                    Sink(solidity);
+                    Sink(trie);
                 }
             }
-            ptr2atomic =
-                &reinterpret_cast<std::atomic<void *> *>(filter_ptr(desired))[traverser.Advance()];
-            expected = nullptr;
+            // go on through the new cell, it may be collapsed again by now
+            expected = desired;
             desired = second_extra;
             second_extra = nullptr;
             inj = InjectorState::kKeyValue;
         }
     }
 
+    FreeCell(spare);
     // cleanup the replaced KV if there is one
     if (expected != nullptr) {
-        mutator.Retire(reinterpret_cast<KV *>(expected));
+        // unlinked by this Put, so nobody else retires it meanwhile
+        on_replace(KV::ValueOf(expected));
+        RetireEntry(mutator, expected);
         return false;
     }
+    AddSize(trie, 1);
     return true;
 }
 
-template <class Key, class Value, class Hasher>
-std::optional<Value> SinkingTree<Key, Value, Hasher>::Get(const Key &key) {
+template <class Key, class Value, class Hasher, class Policy>
+std::optional<Value> SinkingTree<Key, Value, Hasher, Policy>::Get(const Key &key) {
+    if constexpr (kOptimisticReads) {
+        return OptimisticGet(key);
+    }
+    TrieGuard guard(*this);
+    Trie *trie = guard.Get();
     auto mutator = manager_.MakeMutator();
+    auto cells = cell_manager_.MakeMutator();
 
-    Root *root = root_.load(std::memory_order_acquire);
+    Root *root = trie->root.load(std::memory_order_acquire);
     TreeTraverser traverser(key, hasher_);
-    std::atomic<void *> *ptr2atomic = &root->ptrs[traverser.Advance(root->bit_count)];
-    void *ptr = ptr2atomic->load(std::memory_order_acquire);
+    Cursor cursor = Start(root, traverser);
+    void *ptr = cursor.slot->load(std::memory_order_acquire);
 
     while (true) {
+        if (IsFrozen(ptr)) {
+            root = HelpAndRestart(trie, cells, traverser, cursor);
+            ptr = cursor.slot->load(std::memory_order_acquire);
+            continue;
+        }
         if (ptr == nullptr) {
             return std::nullopt;
         }
         if (bits(ptr) & 1) {
-            ptr2atomic =
-                &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[traverser.Advance()];
-            ptr = ptr2atomic->load(std::memory_order_acquire);
+            Descend(cells, root, traverser, cursor, ptr);
             continue;
         }
-        ptr = mutator.Protect(0, *ptr2atomic);
-        if (ptr == nullptr) {
-            return std::nullopt;
-        } else if (bits(ptr) & 1) {
-            ptr2atomic =
-                &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[traverser.Advance()];
-            ptr = ptr2atomic->load(std::memory_order_acquire);
+        ptr = LoadEntry(mutator, *cursor.slot);
+        if (ptr == nullptr || IsFrozen(ptr) || (bits(ptr) & 1)) {
             continue;
         }
-        KV *kv = reinterpret_cast<KV *>(ptr);
         std::optional<Value> ret_val;
-        if (kv->key == key) {
-            ret_val = kv->value;
+        if (KV::Matches(ptr, key, traverser.FirstHash())) {
+            ret_val = KV::ValueOf(ptr);
         }
         return ret_val;
     }
 }
 
-template <class Key, class Value, class Hasher>
-AcceptorState SinkingTree<Key, Value, Hasher>::DeliberateState(void *expected) {
+// Writes nothing shared: neither the Trie nor the cells nor the entry are protected. All of
+// them are type-stable instead, see Recycler, and a Trie changes its generation before
+// anything of it is reused. A walk that finds the generation unchanged at the end went
+// through a Trie in use all along, and so through cells that stayed in place.
+template <class Key, class Value, class Hasher, class Policy>
+std::optional<Value> SinkingTree<Key, Value, Hasher, Policy>::OptimisticGet(const Key &key) {
+    TreeTraverser traverser(key, hasher_);
+    while (true) {
+        Trie *trie = trie_.load(std::memory_order_acquire);
+        uint64_t generation = trie->generation.load(std::memory_order_acquire);
+        if (generation & 1) {
+            continue;
+        }
+        Root *root = trie->root.load(std::memory_order_acquire);
+        std::atomic<void *> *slot = Start(root, traverser).slot;
+        void *ptr = slot->load(std::memory_order_acquire);
+        while (bits(ptr) & 1) {
+            slot = &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[traverser.Advance()];
+            ptr = slot->load(std::memory_order_acquire);
+        }
+        // every read above is an acquire load, the next one cannot move ahead of them
+        std::optional<Value> ret_val;
+        bool read = ptr == nullptr || KV::TryRead(ptr, *slot, key, traverser.FirstHash(), ret_val);
+        if (read && trie->generation.load(std::memory_order_relaxed) == generation) {
+            return ret_val;
+        }
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Function>
+bool SinkingTree<Key, Value, Hasher, Policy>::Visit(const Key &key, Function fn) {
+    TrieGuard guard(*this);
+    Trie *trie = guard.Get();
+    auto mutator = manager_.MakeMutator();
+    auto cells = cell_manager_.MakeMutator();
+
+    Root *root = trie->root.load(std::memory_order_acquire);
+    TreeTraverser traverser(key, hasher_);
+    Cursor cursor = Start(root, traverser);
+    void *ptr = cursor.slot->load(std::memory_order_acquire);
+
+    while (true) {
+        if (IsFrozen(ptr)) {
+            root = HelpAndRestart(trie, cells, traverser, cursor);
+            ptr = cursor.slot->load(std::memory_order_acquire);
+            continue;
+        }
+        if (ptr == nullptr) {
+            return false;
+        }
+        if (bits(ptr) & 1) {
+            Descend(cells, root, traverser, cursor, ptr);
+            continue;
+        }
+        ptr = LoadEntry(mutator, *cursor.slot);
+        if (ptr == nullptr || IsFrozen(ptr) || (bits(ptr) & 1)) {
+            continue;
+        }
+        if (!KV::Matches(ptr, key, traverser.FirstHash())) {
+            return false;
+        }
+        fn(KV::ValueOf(ptr));
+        return true;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::Retrace(const void *entry) const -> TreeTraverser {
+    if constexpr (requires { KV::CachedHash(entry); }) {
+        return TreeTraverser(KV::KeyOf(entry), hasher_, KV::CachedHash(entry));
+    } else {
+        return TreeTraverser(KV::KeyOf(entry), hasher_);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void *SinkingTree<Key, Value, Hasher, Policy>::LoadEntry(typename EntryHazard::Mutator &mutator,
+                                                         std::atomic<void *> &slot,
+                                                         size_t index) {
+    if constexpr (KV::kHeapNode) {
+        return mutator.Protect(index, slot);
+    } else {
+        return slot.load(std::memory_order_acquire);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::RetireEntry(typename EntryHazard::Mutator &mutator,
+                                                          void *entry) {
+    if constexpr (KV::kHeapNode) {
+        mutator.Retire(reinterpret_cast<KV *>(entry));
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::AddSize(Trie *trie, int64_t delta) {
+    if constexpr (Policy::kCountEntries) {
+        trie->size.Add(delta);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+AcceptorState SinkingTree<Key, Value, Hasher, Policy>::DeliberateState(void *expected) {
     if (expected == nullptr) {
         return AcceptorState::kEmpty;
     } else if (bits(expected) & 1) {
@@ -278,80 +959,138 @@ AcceptorState SinkingTree<Key, Value, Hasher>::DeliberateState(void *expected) {
     }
 }
 
-template <class Key, class Value, class Hasher>
-bool SinkingTree<Key, Value, Hasher>::Erase(const Key &key) {
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::Erase(const Key &key) {
+    return Erase(key, [](const Value &) { return true; });
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Predicate>
+bool SinkingTree<Key, Value, Hasher, Policy>::Erase(const Key &key, Predicate pred) {
+    TrieGuard guard(*this);
+    Trie *trie = guard.Get();
     auto mutator = manager_.MakeMutator();
+    auto cells = cell_manager_.MakeMutator();
+    Backoff<Policy::kMaxBackoff> backoff;
 
     TreeTraverser traverser(key, hasher_);
-    Root *root = root_.load(std::memory_order_acquire);
-    std::atomic<void *> *ptr2atomic = &root->ptrs[traverser.Advance(root->bit_count)];
-    void *ptr = ptr2atomic->load(std::memory_order_acquire);
+    Root *root = trie->root.load(std::memory_order_acquire);
+    Cursor cursor = Start(root, traverser);
+    void *ptr = cursor.slot->load(std::memory_order_acquire);
 
     while (true) {
+        if (IsFrozen(ptr)) {
+            root = HelpAndRestart(trie, cells, traverser, cursor);
+            ptr = cursor.slot->load(std::memory_order_acquire);
+            continue;
+        }
         if (ptr == nullptr) {
             return false;
         }
         if (bits(ptr) & 1) {
-            ptr2atomic =
-                &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[traverser.Advance()];
-            ptr = ptr2atomic->load(std::memory_order_acquire);
+            Descend(cells, root, traverser, cursor, ptr);
             continue;
         }
-        ptr = mutator.Protect(0, *ptr2atomic);
-        if (bits(ptr) & 1) {
-            ptr2atomic =
-                &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[traverser.Advance()];
-            ptr = ptr2atomic->load(std::memory_order_acquire);
+        ptr = LoadEntry(mutator, *cursor.slot);
+        if (ptr == nullptr || IsFrozen(ptr) || (bits(ptr) & 1)) {
             continue;
-        } else if (ptr == nullptr) {
+        }
+        void *entry = ptr;
+        if (!KV::Matches(entry, key, traverser.FirstHash()) || !pred(KV::ValueOf(entry))) {
             return false;
-        } else {
-            KV *kv = reinterpret_cast<KV *>(ptr);
-            if (kv->key != key) {
-                return false;
-            }
-            bool cas_success =
-                ptr2atomic->compare_exchange_strong(ptr, nullptr, std::memory_order_acq_rel);
-            if (cas_success) {
-                mutator.Retire(kv);
-                return true;
+        }
+        bool cas_success =
+            cursor.slot->compare_exchange_strong(ptr, nullptr, std::memory_order_acq_rel);
+        if (cas_success) {
+            RetireEntry(mutator, entry);
+            AddSize(trie, -1);
+            if constexpr (kCollapse) {
+                // the cell may be left with a lone entry or none at all
+                if (cursor.level >= static_cast<int>(root->bit_count) + 2) {
+                    auto *slots = reinterpret_cast<std::atomic<void *> *>(cursor.cell);
+                    void *sibling =
+                        slots[cursor.slot == slots ? 1 : 0].load(std::memory_order_relaxed);
+                    if (!(bits(sibling) & 1)) {
+                        CollapsePath(trie, cells, key);
+                    }
+                }
             }
+            return true;
         }
+        BackOff(traverser.FirstHash(), backoff);
     }
 }
 
-template <class Key, class Value, class Hasher>
-SinkingTree<Key, Value, Hasher>::Cell::~Cell() {
-    if (bits(lhs) & 1) {
-        delete reinterpret_cast<Cell *>(filter_ptr(lhs));
-    } else if (lhs != nullptr) {
-        delete reinterpret_cast<KV *>(lhs.load());
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingTree<Key, Value, Hasher, Policy>::Size() const {
+    static_assert(Policy::kCountEntries, "entries are not counted, see ExactSize()");
+    TrieGuard guard(*this);
+    Trie *trie = guard.Get();
+    // an Erase may be counted before the Put it undoes
+    return static_cast<size_t>(std::max<int64_t>(0, trie->size.Load()));
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::Empty() const {
+    return Size() == 0;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingTree<Key, Value, Hasher, Policy>::ExactSize() const {
+    Root *root = trie_.load(std::memory_order_acquire)->root.load(std::memory_order_acquire);
+    size_t count = 0;
+    for (size_t i = 0; i < power(root->bit_count); ++i) {
+        count += CountEntries(root->ptrs[i].load(std::memory_order_acquire));
     }
-    if (bits(rhs) & 1) {
-        delete reinterpret_cast<Cell *>(filter_ptr(rhs));
-    } else if (rhs != nullptr) {
-        delete reinterpret_cast<KV *>(rhs.load());
+    return count;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+size_t SinkingTree<Key, Value, Hasher, Policy>::CountEntries(void *ptr) {
+    if (ptr == nullptr) {
+        return 0;
+    } else if (bits(ptr) & 1) {
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        return CountEntries(cell->lhs.load(std::memory_order_acquire)) +
+               CountEntries(cell->rhs.load(std::memory_order_acquire));
+    } else {
+        return 1;
     }
 }
 
-template <class Key, class Value, class Hasher>
-void SinkingTree<Key, Value, Hasher>::FreeRoot(Root *ptr) {
-    for (size_t i = 0; i < power(ptr->bit_count); ++i) {
-        if (bits(ptr->ptrs[i]) & 1) {
-            SinkingTree<Key, Value, Hasher>::Cell *cptr =
-                reinterpret_cast<Cell *>(filter_ptr(ptr->ptrs[i]));
-            delete cptr;
-        } else if (ptr->ptrs[i] != nullptr) {
-            KV *kv = reinterpret_cast<KV *>(ptr->ptrs[i].load());
-            delete kv;
-        }
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::FreeSlot(void *ptr) {
+    if (bits(ptr) & 1) {
+        // collapsed cells are deleted on their own, so a Cell does not free its children
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        FreeSlot(cell->lhs.load(std::memory_order_relaxed));
+        FreeSlot(cell->rhs.load(std::memory_order_relaxed));
+        FreeCell(cell);
+    } else if (ptr != nullptr) {
+        KV::Free(ptr);
     }
-    free(ptr);
 }
 
-template <class Key, class Value, class Hasher>
-SinkingTree<Key, Value, Hasher>::~SinkingTree() {
-    for (Root *rptr : old_roots_) {
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::FreeRoot(Root *ptr, Recycler *recycler,
+                                                       size_t threads) {
+    parallel::ChunkCursor cursor(power(ptr->bit_count), threads);
+    parallel::RunWorkers(threads, [ptr, &cursor] {
+        size_t begin, end;
+        while (cursor.Next(begin, end)) {
+            for (size_t i = begin; i < end; ++i) {
+                FreeSlot(ptr->ptrs[i].load(std::memory_order_relaxed));
+            }
+        }
+    });
+    DropRoot(ptr, recycler);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::FreeTree(
+    Root *root, const std::array<Root *, kMaxSolidity_> &old_roots, size_t threads,
+    Recycler *recycler) {
+    for (Root *rptr : old_roots) {
         if (rptr == nullptr) {
             continue;
         }
@@ -360,38 +1099,660 @@ SinkingTree<Key, Value, Hasher>::~SinkingTree() {
             cptr->lhs = nullptr;
             cptr->rhs = nullptr;
         }
-        FreeRoot(rptr);
+        FreeRoot(rptr, recycler);
+    }
+    FreeRoot(root, recycler, threads);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+SinkingTree<Key, Value, Hasher, Policy>::~SinkingTree() {
+    Trie *trie = trie_.load();
+    trie->destruction_threads = destruction_threads_;
+    delete trie;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Clear(bool free_in_background) {
+    Trie *old = trie_.exchange(NewTrie(), std::memory_order_acq_rel);
+    if (free_in_background) {
+        old->background = &background_;
+    }
+    auto trie_mutator = trie_manager_.MakeMutator();
+    trie_mutator.Retire(old);
+    // frees it right away unless someone still works on it
+    trie_mutator.Reclaim();
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::SetDestructionThreads(size_t threads) {
+    destruction_threads_ = std::max<size_t>(1, threads);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Visitor>
+void SinkingTree<Key, Value, Hasher, Policy>::VisitSlot(
+    typename EntryHazard::Mutator &mutator, std::atomic<void *> &slot, Visitor &visitor) {
+    void *ptr = slot.load(std::memory_order_acquire);
+    if (ptr == nullptr) {
+        return;
+    }
+    if (!(bits(ptr) & 1)) {
+        ptr = LoadEntry(mutator, slot, kSweepHazard);
+        if (ptr == nullptr) {
+            return;
+        }
+    }
+    if (bits(ptr) & 1) {
+        // the caller keeps collapses away, so cells need no protection
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        VisitSlot(mutator, cell->lhs, visitor);
+        VisitSlot(mutator, cell->rhs, visitor);
+    } else {
+        visitor(slot, ptr);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Visitor>
+void SinkingTree<Key, Value, Hasher, Policy>::SweepSlots(Visitor visitor, size_t threads) {
+    threads = std::max<size_t>(1, threads);
+    // the helpers rely on the protection of the calling thread
+    TrieGuard guard(*this, kSweepHazard);
+    Trie *trie = guard.Get();
+    // Sink keeps the old roots alive and reaching every entry, so a stale root is enough
+    Root *root = trie->root.load(std::memory_order_acquire);
+    parallel::ChunkCursor cursor(power(root->bit_count), threads);
+    // the helpers give their hazard records back as they exit
+    parallel::RunWorkers(threads, [this, trie, root, &cursor, &visitor] {
+        SweepMark mark(this);
+        auto mutator = manager_.MakeMutator();
+        auto cells = cell_manager_.MakeMutator();
+        std::vector<Key> erased_keys;
+        auto bound = [trie, &visitor, &erased_keys](std::atomic<void *> &slot, void *entry) {
+            visitor(*trie, slot, entry, erased_keys);
+        };
+        size_t begin, end;
+        while (cursor.Next(begin, end)) {
+            for (size_t i = begin; i < end; ++i) {
+                {
+                    // per slot, so that collapses go on everywhere else
+                    CollapseBarrier barrier(trie, root, i);
+                    VisitSlot(mutator, root->ptrs[i], bound);
+                }
+                if constexpr (kCollapse) {
+                    CollapsePaths(trie, cells, erased_keys);
+                }
+            }
+        }
+        mutator.Release(kSweepHazard);
+    });
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Function>
+void SinkingTree<Key, Value, Hasher, Policy>::ParallelForEach(Function fn, size_t threads) {
+    SweepSlots(
+        [&fn](Trie &, std::atomic<void *> &, void *entry, std::vector<Key> &) {
+            fn(KV::KeyOf(entry), KV::ValueOf(entry));
+        },
+        threads);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Predicate>
+size_t SinkingTree<Key, Value, Hasher, Policy>::EraseIf(Predicate pred, size_t threads) {
+    std::atomic<size_t> erased{0};
+    SweepSlots(
+        [this, &pred, &erased](Trie &trie, std::atomic<void *> &slot, void *entry,
+                               std::vector<Key> &erased_keys) {
+            if (!pred(KV::KeyOf(entry), KV::ValueOf(entry))) {
+                return;
+            }
+            void *expected = entry;
+            // a concurrent Put replaced or pushed the entry down, it is no longer ours to judge
+            if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+                if constexpr (kCollapse) {
+                    erased_keys.emplace_back(KV::KeyOf(entry));
+                }
+                auto mutator = manager_.MakeMutator();
+                RetireEntry(mutator, entry);
+                AddSize(&trie, -1);
+                erased.fetch_add(1, std::memory_order_relaxed);
+            }
+        },
+        threads);
+    return erased.load(std::memory_order_relaxed);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Predicate, class OnErase>
+size_t SinkingTree<Key, Value, Hasher, Policy>::EraseIfInSlots(size_t first, size_t count,
+                                                               Predicate pred, OnErase on_erase) {
+    SweepMark mark(this);
+    TrieGuard guard(*this, kSweepHazard);
+    Trie *trie = guard.Get();
+    auto mutator = manager_.MakeMutator();
+    size_t erased = 0;
+    // collapsing has to wait for the barriers to go
+    std::vector<Key> erased_keys;
+    {
+        Root *root = trie->root.load(std::memory_order_acquire);
+        size_t mask = power(root->bit_count) - 1;
+        auto visitor = [&](std::atomic<void *> &slot, void *entry) {
+            if (!pred(KV::KeyOf(entry), KV::ValueOf(entry))) {
+                return;
+            }
+            void *expected = entry;
+            if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+                on_erase(KV::KeyOf(entry), KV::ValueOf(entry));
+                if constexpr (kCollapse) {
+                    erased_keys.emplace_back(KV::KeyOf(entry));
+                }
+                RetireEntry(mutator, entry);
+                AddSize(trie, -1);
+                ++erased;
+            }
+        };
+        for (size_t i = first; i < first + count; ++i) {
+            CollapseBarrier barrier(trie, root, i & mask);
+            VisitSlot(mutator, root->ptrs[i & mask], visitor);
+        }
+        mutator.Release(kSweepHazard);
+    }
+    if constexpr (kCollapse) {
+        auto cells = cell_manager_.MakeMutator();
+        CollapsePaths(trie, cells, erased_keys);
+    }
+    return erased;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Merge(SinkingTree &other) {
+    if (&other == this) {
+        return;
+    }
+    Trie *trie = trie_.load(std::memory_order_acquire);
+    Trie *from = other.trie_.load(std::memory_order_acquire);
+    Root *root = trie->root.load(std::memory_order_acquire);
+    Root *src_root = from->root.load(std::memory_order_acquire);
+
+    // Everything below the root of other comes over, the grafts correct for what they split,
+    // join or drop. The cells above are the ones of its old roots, they stay and go with it.
+    GraftStats stats;
+    stats.entries = from->size.Load();
+    for (int level = src_root->bit_count; level <= kMaxSolidity_; ++level) {
+        stats.cells[level - 1] = from->cell_count[level - 1].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < power(src_root->bit_count); ++i) {
+        void *src = src_root->ptrs[i].exchange(nullptr, std::memory_order_relaxed);
+        PlaceSubtree(root, src, i, src_root->bit_count, stats);
+    }
+    ApplyStats(trie, stats, 1);
+    // frees the cells of the old roots of other, nothing below them is left there
+    other.Clear();
+    Sink(trie);
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Predicate>
+size_t SinkingTree<Key, Value, Hasher, Policy>::Split(SinkingTree &other, int prefix_bits,
+                                                      Predicate pred) {
+    assert(prefix_bits < 64);
+    if (&other == this) {
+        return 0;
+    }
+    Trie *trie = trie_.load(std::memory_order_acquire);
+    Trie *into = other.trie_.load(std::memory_order_acquire);
+    Root *root = trie->root.load(std::memory_order_acquire);
+    Root *other_root = into->root.load(std::memory_order_acquire);
+
+    GraftStats taken;
+    GraftStats placed;
+    for (size_t i = 0; i < power(root->bit_count); ++i) {
+        SplitSlot(root->ptrs[i], i, root->bit_count, prefix_bits, pred, other, other_root, taken,
+                  placed);
+    }
+    ApplyStats(trie, taken, -1);
+    ApplyStats(into, taken, 1);
+    ApplyStats(into, placed, 1);
+    other.Sink(into);
+    return taken.entries;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+template <class Predicate>
+void SinkingTree<Key, Value, Hasher, Policy>::SplitSlot(std::atomic<void *> &slot,
+                                                        HashType prefix, int level,
+                                                        int prefix_bits, Predicate &pred,
+                                                        SinkingTree &other, Root *other_root,
+                                                        GraftStats &taken, GraftStats &placed) {
+    void *ptr = slot.load(std::memory_order_relaxed);
+    if (ptr == nullptr) {
+        return;
+    }
+    if (level >= prefix_bits) {
+        // the whole subtree shares the prefix
+        if (pred(prefix & n_bit_mask(prefix_bits))) {
+            slot.store(nullptr, std::memory_order_relaxed);
+            CountSubtree(ptr, level, taken);
+            other.PlaceSubtree(other_root, ptr, prefix, level, placed);
+        }
+    } else if (bits(ptr) & 1) {
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        SplitSlot(cell->lhs, prefix, level + 1, prefix_bits, pred, other, other_root, taken,
+                  placed);
+        SplitSlot(cell->rhs, prefix | static_cast<HashType>(1) << level, level + 1, prefix_bits,
+                  pred, other, other_root, taken, placed);
+    } else {
+        HashType hash = Retrace(ptr).FirstHash();
+        if (pred(hash & n_bit_mask(prefix_bits))) {
+            slot.store(nullptr, std::memory_order_relaxed);
+            taken.entries += 1;
+            other.PlaceSubtree(other_root, ptr, hash & n_bit_mask(level), level, placed);
+        }
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::CountSubtree(void *ptr, int level,
+                                                           GraftStats &stats) {
+    if (ptr == nullptr) {
+        return;
+    } else if (bits(ptr) & 1) {
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        stats.CountCell(level, 1);
+        CountSubtree(cell->lhs.load(std::memory_order_relaxed), level + 1, stats);
+        CountSubtree(cell->rhs.load(std::memory_order_relaxed), level + 1, stats);
+    } else {
+        stats.entries += 1;
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::ApplyStats(Trie *trie, const GraftStats &stats,
+                                                         int sign) {
+    AddSize(trie, sign * stats.entries);
+    for (int level = 1; level <= kMaxSolidity_; ++level) {
+        trie->cell_count[level - 1].fetch_add(sign * stats.cells[level - 1],
+                                              std::memory_order_relaxed);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::PlaceSubtree(Root *root, void *src, HashType prefix,
+                                                           int level, GraftStats &stats) {
+    if (src == nullptr) {
+        return;
+    }
+    int width = static_cast<int>(root->bit_count);
+    if (!(bits(src) & 1)) {
+        InsertEntry(root->ptrs[Retrace(src).Advance(width)], src, width, true, stats);
+    } else if (level < width) {
+        // the subtree spans several root slots here
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(src));
+        PlaceSubtree(root, cell->lhs.load(std::memory_order_relaxed), prefix, level + 1, stats);
+        PlaceSubtree(root, cell->rhs.load(std::memory_order_relaxed),
+                     prefix | static_cast<HashType>(1) << level, level + 1, stats);
+        FreeCell(cell);
+        stats.CountCell(level, -1);
+    } else {
+        std::atomic<void *> *slot = &root->ptrs[prefix & n_bit_mask(width)];
+        for (int depth = width; depth < level; ++depth) {
+            Cell *cell = MakeCell(*slot, depth, stats);
+            slot = &reinterpret_cast<std::atomic<void *> *>(cell)[(prefix >> depth) & 1];
+        }
+        GraftSlot(*slot, src, level, stats);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::GraftSlot(std::atomic<void *> &dst, void *src,
+                                                        int level, GraftStats &stats) {
+    if (src == nullptr) {
+        return;
+    }
+    void *ptr = dst.load(std::memory_order_relaxed);
+    if (ptr == nullptr) {
+        dst.store(src, std::memory_order_relaxed);
+    } else if (!(bits(src) & 1)) {
+        InsertEntry(dst, src, level, true, stats);
+    } else if (!(bits(ptr) & 1)) {
+        // the cell comes over and the entry in place goes below it, losing on an equal key
+        dst.store(src, std::memory_order_relaxed);
+        InsertEntry(dst, ptr, level, false, stats);
+    } else {
+        Cell *into = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        Cell *from = reinterpret_cast<Cell *>(filter_ptr(src));
+        GraftSlot(into->lhs, from->lhs.load(std::memory_order_relaxed), level + 1, stats);
+        GraftSlot(into->rhs, from->rhs.load(std::memory_order_relaxed), level + 1, stats);
+        FreeCell(from);
+        stats.CountCell(level, -1);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::InsertEntry(std::atomic<void *> &dst, void *entry,
+                                                          int level, bool wins,
+                                                          GraftStats &stats) {
+    TreeTraverser path = Retrace(entry);
+    path.Advance(level);
+    std::atomic<void *> *slot = &dst;
+    while (true) {
+        void *ptr = slot->load(std::memory_order_relaxed);
+        if (ptr == nullptr) {
+            slot->store(entry, std::memory_order_relaxed);
+            return;
+        }
+        if (bits(ptr) & 1) {
+            slot = &reinterpret_cast<std::atomic<void *> *>(filter_ptr(ptr))[path.Advance()];
+            ++level;
+            continue;
+        }
+        if (KV::Matches(ptr, KV::KeyOf(entry), path.FirstHash())) {
+            if (wins) {
+                KV::Free(ptr);
+                slot->store(entry, std::memory_order_relaxed);
+            } else {
+                KV::Free(entry);
+            }
+            stats.entries -= 1;
+            return;
+        }
+        MakeCell(*slot, level, stats);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::MakeCell(std::atomic<void *> &slot, int level,
+                                                       GraftStats &stats) -> Cell * {
+    void *ptr = slot.load(std::memory_order_relaxed);
+    if (bits(ptr) & 1) {
+        return reinterpret_cast<Cell *>(filter_ptr(ptr));
+    }
+    Cell *cell = NewCell();
+    if (ptr != nullptr) {
+        TreeTraverser path = Retrace(ptr);
+        path.Advance(level);
+        reinterpret_cast<std::atomic<void *> *>(cell)[path.Advance()].store(
+            ptr, std::memory_order_relaxed);
+    }
+    slot.store(reinterpret_cast<void *>(bits(cell) | 1), std::memory_order_relaxed);
+    stats.CountCell(level, 1);
+    return cell;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::Sink(Trie *trie) {
+    // whoever sinks also takes over the levels the others fill meanwhile
+    while (SinkDue(trie)) {
+        if (trie->sinking.exchange(true, std::memory_order_seq_cst)) {
+            return;
+        }
+        {
+            CollapseBarrier barrier(trie);
+            while (SinkDue(trie) && SinkOnce(trie)) {
+            }
+        }
+        trie->sinking.store(false, std::memory_order_seq_cst);
     }
-    FreeRoot(root_.load());
 }
 
-template <class Key, class Value, class Hasher>
-void SinkingTree<Key, Value, Hasher>::Sink(int solidity) {
-    Root *root;
-    do {
-        root = root_.load(std::memory_order_acquire);
-    } while (root->bit_count != solidity - 2);
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::SinkDue(Trie *trie) {
+    // the level two below the root is full
+    int solidity = trie->root.load(std::memory_order_acquire)->bit_count + 2;
+    return solidity <= kMaxSolidity_ &&
+           trie->cell_count[solidity - 1].load(std::memory_order_seq_cst) == power(solidity);
+}
 
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::SinkOnce(Trie *trie) {
+    Root *root = trie->root.load(std::memory_order_acquire);
     size_t rs = power(root->bit_count);
-    Root *new_root =
-        reinterpret_cast<Root *>(malloc(sizeof(Root) + sizeof(std::atomic<void *>) * 2 * rs));
-    new_root->bit_count = 1 + root->bit_count;
+    Root *new_root = NewRoot(1 + root->bit_count, trie->recycler);
 
     for (size_t i = 0; i < rs; ++i) {
-        Cell *cptr = reinterpret_cast<Cell *>(filter_ptr(root->ptrs[i]));
-        void *lhs = cptr->lhs.load();
-        assert(bits(lhs) & 1);
+        void *ptr = root->ptrs[i].load();
+        void *lhs = nullptr;
+        void *rhs = nullptr;
+        if (bits(ptr) & 1) {
+            Cell *cptr = reinterpret_cast<Cell *>(filter_ptr(ptr));
+            lhs = cptr->lhs.load();
+            rhs = cptr->rhs.load();
+        }
+        // the count runs ahead of a collapse finished by a helper for a moment
+        if (!(bits(lhs) & 1) || !(bits(rhs) & 1)) {
+            DropRoot(new_root, trie->recycler);
+            return false;
+        }
         new_root->ptrs[i] = lhs;
-        void *rhs = cptr->rhs.load();
-        assert(bits(rhs) & 1);
         new_root->ptrs[i + rs] = rhs;
     }
-    root_.store(new_root, std::memory_order_release);
-    old_roots_[solidity - 2] = root;
+    trie->root.store(new_root, std::memory_order_release);
+    trie->old_roots[root->bit_count] = root;
+    return true;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::Start(Root *root, TreeTraverser &traverser)
+    -> Cursor {
+    traverser.Reset();
+    return Cursor{&root->ptrs[traverser.Advance(root->bit_count)]};
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::Descend(typename CellHazard::Mutator &cells,
+                                                      Root *root, TreeTraverser &traverser,
+                                                      Cursor &cursor, void *&ptr) {
+    int level = traverser.BitsConsumed();
+    if constexpr (kCollapse) {
+        // cells this deep may be collapsed and freed under our feet, the ones above never are
+        if (level >= static_cast<int>(root->bit_count) + 2) {
+            void *again = cells.Protect(cursor.hops % kCellHazards, *cursor.slot, [](void *value) {
+                return reinterpret_cast<Cell *>(filter_ptr(value));
+            });
+            if (again != ptr) {
+                ptr = again;
+                return false;
+            }
+            ++cursor.hops;
+        }
+    }
+    cursor.parent = cursor.slot;
+    cursor.cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+    cursor.level = level;
+    cursor.slot = &reinterpret_cast<std::atomic<void *> *>(cursor.cell)[traverser.Advance()];
+    ptr = cursor.slot->load(std::memory_order_acquire);
+    return true;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::HelpAndRestart(Trie *trie,
+                                                             typename CellHazard::Mutator &cells,
+                                                             TreeTraverser &traverser,
+                                                             Cursor &cursor) -> Root * {
+    FinishCollapse(trie, cells, *cursor.parent, cursor.cell, cursor.level);
+    Root *root = trie->root.load(std::memory_order_acquire);
+    cursor = Start(root, traverser);
+    return root;
+}
+
+// A collapse freezes both slots of the cell, after which anyone who runs into the cell can
+// tell the outcome from its frozen contents and put it in place of the cell: nothing for two
+// empty slots, the entry for a lone entry and an unfrozen copy of the cell otherwise. The
+// last case happens when the cell filled up again before it was frozen.
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::FinishCollapse(Trie *trie,
+                                                             typename CellHazard::Mutator &cells,
+                                                             std::atomic<void *> &parent,
+                                                             Cell *cell, int level) {
+    auto *slots = reinterpret_cast<std::atomic<void *> *>(cell);
+    void *children[2];
+    for (int i = 0; i < 2; ++i) {
+        void *child = slots[i].load(std::memory_order_acquire);
+        while (!IsFrozen(child) &&
+               !slots[i].compare_exchange_weak(child, Freeze(child), std::memory_order_acq_rel)) {
+        }
+        children[i] = Thaw(child);
+    }
+
+    bool collapsed = !(bits(children[0]) & 1) && !(bits(children[1]) & 1) &&
+                     (children[0] == nullptr || children[1] == nullptr);
+    void *replacement;
+    Cell *copy = nullptr;
+    if (collapsed) {
+        replacement = children[0] != nullptr ? children[0] : children[1];
+    } else {
+        copy = NewCell();
+        copy->lhs.store(children[0], std::memory_order_relaxed);
+        copy->rhs.store(children[1], std::memory_order_relaxed);
+        replacement = reinterpret_cast<void *>(bits(copy) | 1);
+    }
+
+    void *expected = reinterpret_cast<void *>(bits(cell) | 1);
+    if (parent.compare_exchange_strong(expected, replacement, std::memory_order_acq_rel)) {
+        cells.Retire(cell);
+        if (collapsed && level <= kMaxSolidity_) {
+            trie->cell_count[level - 1].fetch_sub(1);
+        }
+    } else {
+        // someone else finished it, or the parent is being collapsed as well and whoever
+        // walks this way next finishes both
+        FreeCell(copy);
+    }
+    return collapsed;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::CollapsePath(Trie *trie,
+                                                           typename CellHazard::Mutator &cells,
+                                                           const Key &key) {
+    // Frozen cells must not outlive the collapse that froze them, or Sink could promote one
+    // into the root. So the path is walked once more after every collapse, finishing any
+    // frozen cell on it, before Sink and sweeps are let in again.
+    TreeTraverser traverser(key, hasher_);
+    CollapseStripe &stripe = trie->collapse_stripes[traverser.FirstHash() % kCollapseStripes];
+    stripe.collapsing.fetch_add(1, std::memory_order_seq_cst);
+    bool done = true;
+    while (true) {
+        Root *root = trie->root.load(std::memory_order_acquire);
+        Cursor cursor = Start(root, traverser);
+        void *ptr = cursor.slot->load(std::memory_order_acquire);
+        while (IsFrozen(ptr) || (bits(ptr) & 1)) {
+            if (IsFrozen(ptr)) {
+                root = HelpAndRestart(trie, cells, traverser, cursor);
+                ptr = cursor.slot->load(std::memory_order_acquire);
+            } else {
+                Descend(cells, root, traverser, cursor, ptr);
+            }
+        }
+        if (cursor.cell == nullptr || cursor.level < static_cast<int>(root->bit_count) + 2) {
+            break;
+        }
+        if (trie->collapse_blockers.load(std::memory_order_seq_cst) != 0 ||
+            stripe.blockers.load(std::memory_order_seq_cst) != 0) {
+            done = false;
+            break;
+        }
+        void *lhs = cursor.cell->lhs.load(std::memory_order_acquire);
+        void *rhs = cursor.cell->rhs.load(std::memory_order_acquire);
+        if ((bits(lhs) & 3) || (bits(rhs) & 3) || (lhs != nullptr && rhs != nullptr)) {
+            break;
+        }
+        FinishCollapse(trie, cells, *cursor.parent, cursor.cell, cursor.level);
+    }
+    stripe.collapsing.fetch_sub(1, std::memory_order_release);
+    return done;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::CollapsePaths(Trie *trie,
+                                                            typename CellHazard::Mutator &cells,
+                                                            std::vector<Key> &keys) {
+    // barriers stand for short stretches only, the ones held off go again after a yield
+    while (!keys.empty()) {
+        std::erase_if(keys, [this, trie, &cells](const Key &key) {
+            return CollapsePath(trie, cells, key);
+        });
+        if (!keys.empty()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::GetShape() const -> Shape {
+    Root *root = trie_.load(std::memory_order_acquire)->root.load(std::memory_order_acquire);
+    Shape shape;
+    size_t entries = 0;
+    for (size_t i = 0; i < power(root->bit_count); ++i) {
+        MeasureShape(root->ptrs[i].load(std::memory_order_acquire), 0, shape, entries);
+    }
+    if (entries != 0) {
+        shape.average_depth /= static_cast<double>(entries);
+    }
+    return shape;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::MeasureShape(void *ptr, size_t depth, Shape &shape,
+                                                           size_t &entries) {
+    if (ptr == nullptr) {
+        return;
+    } else if (bits(ptr) & 1) {
+        Cell *cell = reinterpret_cast<Cell *>(filter_ptr(ptr));
+        ++shape.cells;
+        MeasureShape(cell->lhs.load(std::memory_order_acquire), depth + 1, shape, entries);
+        MeasureShape(cell->rhs.load(std::memory_order_acquire), depth + 1, shape, entries);
+    } else {
+        ++entries;
+        shape.max_depth = std::max(shape.max_depth, depth);
+        shape.average_depth += static_cast<double>(depth);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+bool SinkingTree<Key, Value, Hasher, Policy>::BackOff(HashType first_hash,
+                                                      Backoff<Policy::kMaxBackoff> &backoff) {
+    if constexpr (Policy::kRetryStats) {
+        retry_buckets_[first_hash % kRetryBuckets].retries.fetch_add(1, std::memory_order_relaxed);
+    }
+    backoff.Pause();
+    return true;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::CountElimination(HashType first_hash) {
+    if constexpr (Policy::kRetryStats) {
+        retry_buckets_[first_hash % kRetryBuckets].eliminated.fetch_add(
+            1, std::memory_order_relaxed);
+    }
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+auto SinkingTree<Key, Value, Hasher, Policy>::GetRetryStats() const -> RetryStats {
+    RetryStats stats;
+    for (const RetryBucket &bucket : retry_buckets_) {
+        uint64_t retries = bucket.retries.load(std::memory_order_relaxed);
+        stats.retries += retries;
+        stats.eliminated += bucket.eliminated.load(std::memory_order_relaxed);
+        stats.retries_by_slot.push_back(retries);
+    }
+    return stats;
+}
+
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::ResetRetryStats() {
+    for (RetryBucket &bucket : retry_buckets_) {
+        bucket.retries.store(0, std::memory_order_relaxed);
+        bucket.eliminated.store(0, std::memory_order_relaxed);
+    }
 }
 
-template <class Key, class Value, class Hasher>
-void SinkingTree<Key, Value, Hasher>::CleanupHazard() {
+template <class Key, class Value, class Hasher, class Policy>
+void SinkingTree<Key, Value, Hasher, Policy>::CleanupHazard() {
     manager_.Cleanup();
+    cell_manager_.Cleanup();
+    trie_manager_.Cleanup();
 }
 }  // namespace sinking_tree
@@ -1,9 +1,18 @@
 #include "commons.h"
 #include "runner.h"
+#include "compact_tree.h"
+#include "sinking_cache.h"
+#include "test_policies.h"
 #include "unordered_cc_map.h"
+#include <memory>
 #include <ranges>
 #include "mutexed_std.h"
 
+#include <malloc.h>
+#include <iostream>
+#include <string>
+#include <thread>
+
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 #include <catch2/benchmark/catch_benchmark.hpp>
@@ -12,6 +21,12 @@ static constexpr auto kSeed = 14753334;
 
 using namespace sinking_tree;
 
+// bytes currently handed out by malloc, operator new included
+static size_t HeapInUse() {
+    auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
 TEST_CASE("Benchmark inserts") {
     static constexpr auto kNumIterations = 100'000;
     for (uint thread_count = 1; thread_count <= 8; thread_count *= 2) {
@@ -118,3 +133,782 @@ TEST_CASE("Benchmark reads") {
         };
     }
 }
+
+TEST_CASE("Benchmark sharded inserts") {
+    static constexpr auto kNumIterations = 100'000;
+    static constexpr auto kShards = 256;
+    for (uint thread_count = 1; thread_count <= 8; thread_count *= 2) {
+        BENCHMARK_ADVANCED("ShardedInsertions: " + std::to_string(thread_count) + ", " +
+                           std::to_string(kShards))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> shards;
+            for (int i = 0; i < kShards; ++i) {
+                shards.push_back(std::make_unique<SinkingTree<int, int>>(kNumIterations / kShards));
+            }
+            meter.measure([thread_count, &shards]() {
+                {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i};
+                        runner.Do([&shards, rand]() mutable {
+                            auto key = rand();
+                            shards[static_cast<unsigned>(key) % kShards]->Put(key, 1);
+                        });
+                    }
+                }
+                for (auto& shard : shards) {
+                    shard->CleanupHazard();
+                }
+            });
+        };
+
+        BENCHMARK_ADVANCED("ShardedInsertions(std): " + std::to_string(thread_count) + ", " +
+                           std::to_string(kShards))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<Baseline<int, int>>> shards;
+            for (int i = 0; i < kShards; ++i) {
+                shards.push_back(std::make_unique<Baseline<int, int>>(kNumIterations / kShards));
+            }
+            meter.measure([thread_count, &shards]() {
+                Runner runner{kNumIterations};
+                for (auto i : std::views::iota(0u, thread_count)) {
+                    Random rand{kSeed + 10 * i};
+                    runner.Do([&shards, rand]() mutable {
+                        auto key = rand();
+                        shards[static_cast<unsigned>(key) % kShards]->Put(key, 1);
+                    });
+                }
+            });
+        };
+    }
+}
+
+TEST_CASE("Benchmark entry counters") {
+    static constexpr auto kNumIterations = 1'000'000;
+    const uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        BENCHMARK_ADVANCED("StripedCounter: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            StripedCounter<> counter;
+            meter.measure([thread_count, &counter]() {
+                Runner runner{kNumIterations};
+                for (uint i = 0; i < thread_count; ++i) {
+                    runner.Do([&counter]() { counter.Add(1); });
+                }
+            });
+        };
+
+        BENCHMARK_ADVANCED("SharedCounter: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            std::atomic<int64_t> counter{0};
+            meter.measure([thread_count, &counter]() {
+                Runner runner{kNumIterations};
+                for (uint i = 0; i < thread_count; ++i) {
+                    runner.Do(
+                        [&counter]() { counter.fetch_add(1, std::memory_order_relaxed); });
+                }
+            });
+        };
+
+        BENCHMARK_ADVANCED("RandomInsertions(counted): " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<int, int> map(kNumIterations / 10);
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations / 10};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i};
+                        runner.Do([&map, rand]() mutable { map.Put(rand(), 1); });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+
+        BENCHMARK_ADVANCED("RandomInsertions(uncounted): " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<int, int, DefaultHasher<int>, NoEntryCounts> map(kNumIterations / 10);
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations / 10};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i};
+                        runner.Do([&map, rand]() mutable { map.Put(rand(), 1); });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+
+        BENCHMARK_ADVANCED("RandomInsertionsWithSize: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<int, int> map(kNumIterations / 10);
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations / 10};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i};
+                        runner.Do([&map, rand]() mutable {
+                            auto key = rand();
+                            if (key % 64 == 0) {
+                                map.Size();
+                            } else {
+                                map.Put(key, 1);
+                            }
+                        });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+    }
+}
+
+TEST_CASE("Benchmark bulk operations") {
+    static constexpr auto kSize = 200'000;
+    auto make_map = [] {
+        auto map = std::make_unique<SinkingTree<int, int>>(kSize);
+        Random rand{kSeed};
+        for (int i = 0; i < kSize; ++i) {
+            map->Put(rand(), i);
+        }
+        return map;
+    };
+    for (uint thread_count = 1; thread_count <= 8; thread_count *= 2) {
+        BENCHMARK_ADVANCED("ParallelForEach: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            auto map = make_map();
+            std::atomic<int64_t> sum{0};
+            meter.measure([thread_count, &map, &sum]() {
+                map->ParallelForEach([&sum](int, int value) { sum.fetch_add(value); },
+                                     thread_count);
+            });
+        };
+
+        BENCHMARK_ADVANCED("EraseIf: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> maps(meter.runs());
+            for (auto& map : maps) {
+                map = make_map();
+            }
+            meter.measure([thread_count, &maps](int i) {
+                return maps[i]->EraseIf([](int, int value) { return value % 2 == 0; },
+                                        thread_count);
+            });
+        };
+
+        BENCHMARK_ADVANCED("Destruction: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> maps(meter.runs());
+            for (auto& map : maps) {
+                map = make_map();
+                map->SetDestructionThreads(thread_count);
+            }
+            meter.measure([&maps](int i) { maps[i].reset(); });
+        };
+    }
+}
+
+TEST_CASE("Benchmark clear") {
+    for (int size = 1'000; size <= 100'000; size *= 10) {
+        auto make_map = [size] {
+            auto map = std::make_unique<SinkingTree<int, int>>(16);
+            Random rand{kSeed};
+            for (int i = 0; i < size; ++i) {
+                map->Put(rand(), i);
+            }
+            return map;
+        };
+
+        BENCHMARK_ADVANCED("Clear(background): " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> maps(meter.runs());
+            for (auto& map : maps) {
+                map = make_map();
+            }
+            meter.measure([&maps](int i) { maps[i]->Clear(true); });
+        };
+
+        BENCHMARK_ADVANCED("Clear(inline): " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> maps(meter.runs());
+            for (auto& map : maps) {
+                map = make_map();
+            }
+            meter.measure([&maps](int i) { maps[i]->Clear(); });
+        };
+
+        BENCHMARK_ADVANCED("EraseAll: " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::unique_ptr<SinkingTree<int, int>>> maps(meter.runs());
+            for (auto& map : maps) {
+                map = make_map();
+            }
+            meter.measure([size, &maps](int i) {
+                Random rand{kSeed};
+                for (int j = 0; j < size; ++j) {
+                    maps[i]->Erase(rand());
+                }
+            });
+        };
+    }
+}
+
+TEST_CASE("Benchmark string keys") {
+    static constexpr auto kSize = 100'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    std::vector<std::string> memory_report;
+    for (size_t length = 16; length <= 128; length *= 2) {
+        std::vector<std::string> keys;
+        Random rand{kSeed, 'a', 'z'};
+        for (int i = 0; i < kSize; ++i) {
+            std::string key(length, ' ');
+            for (auto& c : key) {
+                c = static_cast<char>(rand());
+            }
+            keys.push_back(std::move(key));
+        }
+
+        {
+            auto before = HeapInUse();
+            SinkingTree<std::string, int> map(kSize);
+            for (const auto& key : keys) {
+                map.Put(key, 1);
+            }
+            memory_report.push_back("StringReads(inline): " + std::to_string(length) +
+                                    " bytes per key, " +
+                                    std::to_string((HeapInUse() - before) / kSize) +
+                                    " bytes per entry");
+
+            BENCHMARK_ADVANCED("StringReads(inline): " + std::to_string(length))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([&map, &keys]() {
+                    {
+                        Runner runner{kNumIterations};
+                        Random rand{kSeed, 0, kSize - 1};
+                        runner.Do([&map, &keys, rand]() mutable { map.Get(keys[rand()]); });
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+
+        {
+            auto before = HeapInUse();
+            SinkingTree<std::string, int, DefaultHasher<std::string>, PlainKeys> map(kSize);
+            for (const auto& key : keys) {
+                map.Put(key, 1);
+            }
+            memory_report.push_back("StringReads(plain): " + std::to_string(length) +
+                                    " bytes per key, " +
+                                    std::to_string((HeapInUse() - before) / kSize) +
+                                    " bytes per entry");
+
+            BENCHMARK_ADVANCED("StringReads(plain): " + std::to_string(length))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([&map, &keys]() {
+                    {
+                        Runner runner{kNumIterations};
+                        Random rand{kSeed, 0, kSize - 1};
+                        runner.Do([&map, &keys, rand]() mutable { map.Get(keys[rand()]); });
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+    for (const auto& line : memory_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark packed entries") {
+    static constexpr auto kSize = 1'000'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    std::vector<std::string> memory_report;
+
+    {
+        auto before = HeapInUse();
+        SinkingTree<uint32_t, uint16_t> map(kSize);
+        for (uint32_t i = 0; i < kSize; ++i) {
+            map.Put(i, static_cast<uint16_t>(i));
+        }
+        memory_report.push_back("SmallReads(packed): " +
+                                std::to_string((HeapInUse() - before) / kSize) +
+                                " bytes per entry");
+
+        for (uint thread_count = 1; thread_count <= 4; thread_count *= 2) {
+            BENCHMARK_ADVANCED("SmallReads(packed): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+
+    {
+        auto before = HeapInUse();
+        SinkingTree<uint32_t, uint16_t, DefaultHasher<uint32_t>, NoPacking> map(kSize);
+        for (uint32_t i = 0; i < kSize; ++i) {
+            map.Put(i, static_cast<uint16_t>(i));
+        }
+        memory_report.push_back("SmallReads(nodes): " +
+                                std::to_string((HeapInUse() - before) / kSize) +
+                                " bytes per entry");
+
+        for (uint thread_count = 1; thread_count <= 4; thread_count *= 2) {
+            BENCHMARK_ADVANCED("SmallReads(nodes): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+    for (const auto& line : memory_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark optimistic reads") {
+    static constexpr auto kSize = 100'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    const uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+
+        BENCHMARK_ADVANCED("ProtectedReads: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<uint64_t, uint64_t> map(kSize);
+            for (uint64_t i = 0; i < kSize; ++i) {
+                map.Put(i, i);
+            }
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i, 0, kSize - 1};
+                        runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+
+        // optimistic reads never collapse cells, so the same without the protected collapses
+        BENCHMARK_ADVANCED("ProtectedReads(no collapse): " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<uint64_t, uint64_t, DefaultHasher<uint64_t>, NoCollapse> map(kSize);
+            for (uint64_t i = 0; i < kSize; ++i) {
+                map.Put(i, i);
+            }
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i, 0, kSize - 1};
+                        runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+
+        BENCHMARK_ADVANCED("OptimisticReads: " + std::to_string(thread_count))
+        (Catch::Benchmark::Chronometer meter) {
+            SinkingTree<uint64_t, uint64_t, DefaultHasher<uint64_t>, OptimisticReads> map(kSize);
+            for (uint64_t i = 0; i < kSize; ++i) {
+                map.Put(i, i);
+            }
+            meter.measure([thread_count, &map]() {
+                {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Random rand{kSeed + 10 * i, 0, kSize - 1};
+                        runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                    }
+                }
+                map.CleanupHazard();
+            });
+        };
+    }
+}
+
+TEST_CASE("Benchmark churn") {
+    static constexpr auto kKeys = 1 << 20;
+    static constexpr auto kChurn = 4'000'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    // the map grows well past its capacity, then mostly shrinks back
+    auto churn = [](auto& map) {
+        Random rand{kSeed, 0, kKeys - 1};
+        for (int i = 0; i < kChurn; ++i) {
+            if (i < kChurn / 2 ? i % 3 != 0 : i % 5 == 0) {
+                map.Put(rand(), i);
+            } else {
+                map.Erase(rand());
+            }
+        }
+        map.CleanupHazard();
+    };
+    auto describe = [](auto& map, size_t before) {
+        auto shape = map.GetShape();
+        return std::to_string(map.ExactSize()) + " entries, " + std::to_string(shape.cells) +
+               " cells, depth " + std::to_string(shape.average_depth) + " on average, " +
+               std::to_string(shape.max_depth) + " at most, " +
+               std::to_string((HeapInUse() - before) >> 10) + " KiB";
+    };
+    std::vector<std::string> shape_report;
+
+    {
+        auto before = HeapInUse();
+        SinkingTree<int, int> map(1024);
+        churn(map);
+        shape_report.push_back("Collapse: " + describe(map, before));
+
+        BENCHMARK_ADVANCED("Collapse: reads after churn")
+        (Catch::Benchmark::Chronometer meter) {
+            meter.measure([&map]() {
+                Runner runner{kNumIterations};
+                Random rand{kSeed + 1, 0, kKeys - 1};
+                runner.Do([&map, rand]() mutable { map.Get(rand()); });
+            });
+        };
+    }
+
+    {
+        auto before = HeapInUse();
+        SinkingTree<int, int, DefaultHasher<int>, NoCollapse> map(1024);
+        churn(map);
+        shape_report.push_back("NoCollapse: " + describe(map, before));
+
+        BENCHMARK_ADVANCED("NoCollapse: reads after churn")
+        (Catch::Benchmark::Chronometer meter) {
+            meter.measure([&map]() {
+                Runner runner{kNumIterations};
+                Random rand{kSeed + 1, 0, kKeys - 1};
+                runner.Do([&map, rand]() mutable { map.Get(rand()); });
+            });
+        };
+    }
+    for (const auto& line : shape_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark skewed writes") {
+    static constexpr auto kKeys = 100'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    const uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    auto describe = [](const auto& stats) {
+        auto hottest =
+            std::max_element(stats.retries_by_slot.begin(), stats.retries_by_slot.end());
+        return std::to_string(stats.retries) + " retries, " + std::to_string(stats.eliminated) +
+               " eliminated, " +
+               std::to_string(hottest == stats.retries_by_slot.end() ? 0 : *hottest) +
+               " in the hottest slot bucket";
+    };
+    std::vector<std::string> retry_report;
+    for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        {
+            SinkingTree<int, int, DefaultHasher<int>, RetryStatsPolicy> map(kKeys);
+            BENCHMARK_ADVANCED("SkewedPuts: " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Zipf zipf{kSeed + 10 * i, kKeys};
+                            runner.Do([&map, zipf, i]() mutable {
+                                map.Put(static_cast<int>(zipf()), static_cast<int>(i));
+                            });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+            retry_report.push_back("SkewedPuts: " + std::to_string(thread_count) +
+                                   " threads, " + describe(map.GetRetryStats()));
+        }
+
+        {
+            SinkingTree<int, int, DefaultHasher<int>, NoBackoff> map(kKeys);
+            BENCHMARK_ADVANCED("SkewedPuts(no backoff): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Zipf zipf{kSeed + 10 * i, kKeys};
+                            runner.Do([&map, zipf, i]() mutable {
+                                map.Put(static_cast<int>(zipf()), static_cast<int>(i));
+                            });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+            retry_report.push_back("SkewedPuts(no backoff): " + std::to_string(thread_count) +
+                                   " threads, " + describe(map.GetRetryStats()));
+        }
+    }
+    for (const auto& line : retry_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark cache") {
+    static constexpr auto kKeys = 1'000'000;
+    static constexpr auto kCapacity = 100'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    const uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    struct alignas(64) Counts {
+        size_t lookups{0};
+        size_t hits{0};
+    };
+    // a lookup in front of a slow store, filled on a miss
+    auto lookup = [](auto& cache, int key, Counts& count) {
+        ++count.lookups;
+        if (cache.Get(key)) {
+            ++count.hits;
+        } else {
+            cache.Put(key, key);
+        }
+    };
+    auto describe = [](const std::vector<Counts>& counts) {
+        size_t lookups = 0, hits = 0;
+        for (const auto& count : counts) {
+            lookups += count.lookups;
+            hits += count.hits;
+        }
+        return std::to_string(100.0 * hits / std::max<size_t>(1, lookups)) + "% hits";
+    };
+    std::vector<std::string> hit_report;
+    for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+        {
+            SinkingCache<int, int> cache(kCapacity);
+            std::vector<Counts> counts(thread_count);
+            BENCHMARK_ADVANCED("ZipfCache(clock): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &cache, &counts, &lookup]() {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Zipf zipf{kSeed + 10 * i, kKeys};
+                        runner.Do([&cache, &lookup, zipf, &count = counts[i]]() mutable {
+                            lookup(cache, static_cast<int>(zipf()), count);
+                        });
+                    }
+                });
+            };
+            hit_report.push_back("ZipfCache(clock): " + std::to_string(thread_count) +
+                                 " threads, " + describe(counts));
+        }
+
+        {
+            LruBaseline<int, int> cache(kCapacity);
+            std::vector<Counts> counts(thread_count);
+            BENCHMARK_ADVANCED("ZipfCache(std lru): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &cache, &counts, &lookup]() {
+                    Runner runner{kNumIterations};
+                    for (auto i : std::views::iota(0u, thread_count)) {
+                        Zipf zipf{kSeed + 10 * i, kKeys};
+                        runner.Do([&cache, &lookup, zipf, &count = counts[i]]() mutable {
+                            lookup(cache, static_cast<int>(zipf()), count);
+                        });
+                    }
+                });
+            };
+            hit_report.push_back("ZipfCache(std lru): " + std::to_string(thread_count) +
+                                 " threads, " + describe(counts));
+        }
+    }
+    for (const auto& line : hit_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark compact refs") {
+    static constexpr auto kSize = 1'000'000;
+    static constexpr auto kNumIterations = 1'000'000;
+    const uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    // sized by the default, the root grows by sinking as it would in production
+    auto fill = [](auto& map) {
+        auto before = HeapInUse();
+        for (uint32_t i = 0; i < kSize; ++i) {
+            map.Put(i, i);
+        }
+        return std::to_string((HeapInUse() - before) / kSize) + " bytes per entry";
+    };
+    std::vector<std::string> memory_report;
+
+    {
+        SinkingTree<uint64_t, uint64_t> map;
+        memory_report.push_back("Reads(pointers): " + fill(map));
+        for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            BENCHMARK_ADVANCED("Reads(pointers): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+
+    {
+        CompactSinkingTree<uint64_t, uint64_t> map;
+        memory_report.push_back("Reads(compact): " + fill(map));
+        for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            BENCHMARK_ADVANCED("Reads(compact): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+
+    {
+        SinkingTree<uint32_t, uint32_t, DefaultHasher<uint32_t>, NoPacking> map;
+        memory_report.push_back("SmallReads(pointers): " + fill(map));
+        for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            BENCHMARK_ADVANCED("SmallReads(pointers): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+
+    {
+        CompactSinkingTree<uint32_t, uint32_t> map;
+        memory_report.push_back("SmallReads(compact): " + fill(map));
+        for (uint thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+            BENCHMARK_ADVANCED("SmallReads(compact): " + std::to_string(thread_count))
+            (Catch::Benchmark::Chronometer meter) {
+                meter.measure([thread_count, &map]() {
+                    {
+                        Runner runner{kNumIterations};
+                        for (auto i : std::views::iota(0u, thread_count)) {
+                            Random rand{kSeed + 10 * i, 0, kSize - 1};
+                            runner.Do([&map, rand]() mutable { map.Get(rand()); });
+                        }
+                    }
+                    map.CleanupHazard();
+                });
+            };
+        }
+    }
+    for (const auto& line : memory_report) {
+        std::cout << line << std::endl;
+    }
+}
+
+TEST_CASE("Benchmark merge and split") {
+    using Map = SinkingTree<int, int>;
+    for (int size = 10'000; size <= 1'000'000; size *= 10) {
+        // the second one gets the keys of odd ranks
+        auto make_pair = [size] {
+            auto maps = std::make_pair(std::make_unique<Map>(), std::make_unique<Map>());
+            Random rand{kSeed};
+            for (int i = 0; i < size; ++i) {
+                (i % 2 ? maps.second : maps.first)->Put(rand(), i);
+            }
+            return maps;
+        };
+        auto make_one = [size] {
+            auto maps = std::make_pair(std::make_unique<Map>(), std::make_unique<Map>());
+            Random rand{kSeed};
+            for (int i = 0; i < size; ++i) {
+                maps.first->Put(rand(), i);
+            }
+            return maps;
+        };
+        auto even = [](HashType prefix) { return prefix == 0; };
+        auto even_hash = [](int key) { return (DefaultHasher<int>()(key, 0) & 1) == 0; };
+
+        BENCHMARK_ADVANCED("Merge: " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::pair<std::unique_ptr<Map>, std::unique_ptr<Map>>> maps(meter.runs());
+            for (auto& pair : maps) {
+                pair = make_pair();
+            }
+            meter.measure([&maps](int i) { maps[i].first->Merge(*maps[i].second); });
+        };
+
+        BENCHMARK_ADVANCED("Merge(reinsert): " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::pair<std::unique_ptr<Map>, std::unique_ptr<Map>>> maps(meter.runs());
+            for (auto& pair : maps) {
+                pair = make_pair();
+            }
+            meter.measure([&maps](int i) {
+                auto& [lhs, rhs] = maps[i];
+                rhs->ParallelForEach([&lhs](int key, int value) { lhs->Put(key, value); });
+                rhs->Clear();
+            });
+        };
+
+        BENCHMARK_ADVANCED("Split: " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::pair<std::unique_ptr<Map>, std::unique_ptr<Map>>> maps(meter.runs());
+            for (auto& pair : maps) {
+                pair = make_one();
+            }
+            meter.measure([&maps, even](int i) { maps[i].first->Split(*maps[i].second, 1, even); });
+        };
+
+        BENCHMARK_ADVANCED("Split(reinsert): " + std::to_string(size))
+        (Catch::Benchmark::Chronometer meter) {
+            std::vector<std::pair<std::unique_ptr<Map>, std::unique_ptr<Map>>> maps(meter.runs());
+            for (auto& pair : maps) {
+                pair = make_one();
+            }
+            meter.measure([&maps, even_hash](int i) {
+                auto& [lhs, rhs] = maps[i];
+                lhs->EraseIf([&rhs, even_hash](int key, int value) {
+                    if (!even_hash(key)) {
+                        return false;
+                    }
+                    rhs->Put(key, value);
+                    return true;
+                });
+            });
+        };
+    }
+}
@@ -1,10 +1,17 @@
+#include "compact_tree.h"
+#include "sinking_cache.h"
+#include "test_policies.h"
 #include "unordered_cc_map.h"
 #include "runner.h"
 #include "commons.h"
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
 #include <ranges>
+#include <thread>
 
 using namespace sinking_tree;
 
@@ -14,18 +21,330 @@ TEST_CASE("Multistress") {
 
     const int kNumIterations = 1'000'000;
 
-    Runner runner{kNumIterations};
-    for (auto i : std::views::iota(0u, kNumThreads)) {
-        Random rand{i};
-        runner.Do([&my, rand]() mutable {
-            auto choice = rand() % 100;
-            if (choice < 20) {
-                my.Put(rand(), 1);
-            } else if (choice < 40) {
-                my.Erase(rand());
-            } else {
-                my.Get(rand());
-            }
-        });
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&my, rand]() mutable {
+                auto choice = rand() % 1000;
+                if (choice < 200) {
+                    my.Put(rand(), 1);
+                } else if (choice < 400) {
+                    my.Erase(rand());
+                } else if (choice < 401) {
+                    my.Clear(rand() % 2 == 0);
+                } else {
+                    my.Get(rand());
+                }
+            });
+        }
     }
+    REQUIRE(my.Size() == my.ExactSize());
+}
+
+TEST_CASE("Multistress on many instances") {
+    static constexpr auto kShards = 4;
+    std::vector<std::unique_ptr<SinkingTree<int, int>>> shards;
+    for (int i = 0; i < kShards; ++i) {
+        shards.push_back(std::make_unique<SinkingTree<int, int>>(16));
+    }
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&shards, rand]() mutable {
+                auto& my = *shards[static_cast<unsigned>(rand()) % kShards];
+                auto key = rand() % 1000;
+                auto choice = rand() % 100;
+                if (choice < 20) {
+                    my.Put(key, 1);
+                } else if (choice < 40) {
+                    my.Erase(key);
+                } else {
+                    my.Get(key);
+                }
+            });
+        }
+    }
+    for (auto& my : shards) {
+        REQUIRE(my->Size() == my->ExactSize());
+    }
+}
+
+TEST_CASE("Multistress with bulk operations") {
+    SinkingTree<int, int> my(16);
+    const auto kNumThreads = GENERATE(2u, 4u);
+
+    const int kNumIterations = 100'000;
+
+    std::atomic<bool> done{false};
+    std::atomic<bool> consistent{true};
+    std::jthread sweeper([&my, &done, &consistent] {
+        while (!done.load()) {
+            my.EraseIf([](int key, int) { return key % 3 == 0; }, 2);
+            // the callback goes back into the map, which must keep the sweep protected
+            my.ParallelForEach(
+                [&my, &consistent](int key, int value) {
+                    auto found = my.Get(key);
+                    if (key != value || (found && *found != key)) {
+                        consistent.store(false);
+                    }
+                },
+                2);
+        }
+    });
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&my, rand]() mutable {
+                auto key = rand() % 1000;
+                auto choice = rand() % 100;
+                if (choice < 30) {
+                    my.Put(key, key);
+                } else if (choice < 50) {
+                    my.Erase(key);
+                } else if (choice < 51) {
+                    my.Clear();
+                } else {
+                    my.Get(key);
+                }
+            });
+        }
+    }
+    done.store(true);
+    sweeper.join();
+    REQUIRE(consistent.load());
+    REQUIRE(my.Size() == my.ExactSize());
+}
+
+TEST_CASE("Multistress on packed entries") {
+    SinkingTree<uint32_t, uint16_t> my(8);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&my, &mismatch, rand]() mutable {
+                uint32_t key = rand() % 100'000;
+                auto choice = rand() % 1000;
+                if (choice < 300) {
+                    my.Put(key, static_cast<uint16_t>(key * 7));
+                } else if (choice < 600) {
+                    my.Erase(key);
+                } else if (auto value = my.Get(key); value && *value != uint16_t(key * 7)) {
+                    mismatch = true;
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(my.Size() == my.ExactSize());
+}
+
+TEST_CASE("Multistress on optimistic reads") {
+    // every value is derived from its key, so a torn or stale copy shows up
+    using Value = std::array<uint64_t, 4>;
+    SinkingTree<uint64_t, Value, DefaultHasher<uint64_t>, OptimisticReads> my(8);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&my, &mismatch, rand]() mutable {
+                uint64_t key = rand() % 1'000;
+                auto choice = rand() % 1000;
+                if (choice < 300) {
+                    uint64_t stamp = rand();
+                    my.Put(key, Value{key, stamp, key ^ stamp, key + stamp});
+                } else if (choice < 600) {
+                    my.Erase(key);
+                } else if (choice < 601) {
+                    // readers may still walk the old tree while it is reused
+                    my.Clear(rand() % 2 == 0);
+                } else if (auto value = my.Get(key);
+                           value && ((*value)[0] != key || (*value)[2] != (key ^ (*value)[1]) ||
+                                     (*value)[3] != key + (*value)[1])) {
+                    mismatch = true;
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(my.Size() == my.ExactSize());
+}
+
+TEST_CASE("Multistress with collapses") {
+    // a small key range keeps cells being split and collapsed on the same paths
+    SinkingTree<int, int> my(2);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i};
+            runner.Do([&my, &mismatch, rand]() mutable {
+                int key = rand() % 5'000;
+                auto choice = rand() % 1000;
+                if (choice < 300) {
+                    my.Put(key, key * 3);
+                } else if (choice < 650) {
+                    my.Erase(key);
+                } else if (auto value = my.Get(key); value && *value != key * 3) {
+                    mismatch = true;
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(my.Size() == my.ExactSize());
+    for (int key = -5'000; key < 5'000; ++key) {
+        my.Erase(key);
+    }
+    REQUIRE(my.ExactSize() == 0);
+    REQUIRE(my.GetShape().max_depth == 0);
+
+    // sweeps collapse what they erase as well
+    for (int key = 0; key < 5'000; ++key) {
+        my.Put(key, key * 3);
+    }
+    size_t cells = my.GetShape().cells;
+    REQUIRE(my.EraseIf([](int, int) { return true; }, kNumThreads) == 5'000);
+    REQUIRE(my.ExactSize() == 0);
+    REQUIRE(my.GetShape().max_depth == 0);
+    REQUIRE(my.GetShape().cells < cells / 2);
+}
+
+TEST_CASE("Collapses alongside sweeps") {
+    SinkingTree<int, int> my(1 << 10);
+    for (int key = 0; key < 200'000; ++key) {
+        my.Put(key, key);
+    }
+    size_t cells = my.GetShape().cells;
+
+    // a sweep holds collapses off the slot it is in only
+    std::atomic<bool> done{false};
+    std::jthread sweeper([&my, &done] {
+        for (size_t hand = 0; !done.load(); hand += 8) {
+            my.EraseIfInSlots(hand, 8, [](int, int) { return false; }, [](int, int) {});
+        }
+    });
+    for (int key = 0; key < 200'000; ++key) {
+        my.Erase(key);
+    }
+    done.store(true);
+    sweeper.join();
+    REQUIRE(my.GetShape().cells < cells / 2);
+}
+
+TEST_CASE("Multistress on hot keys") {
+    SinkingTree<int, int, DefaultHasher<int>, RetryStatsPolicy> my(16);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Zipf zipf{i, 1'000, 1.2};
+            Random rand{i, 0, 999};
+            runner.Do([&my, &mismatch, zipf, rand]() mutable {
+                int key = static_cast<int>(zipf());
+                auto choice = rand();
+                if (choice < 700) {
+                    my.Put(key, key + 1'000 * rand());
+                } else if (choice < 750) {
+                    my.Erase(key);
+                } else if (auto value = my.Get(key); value && *value % 1'000 != key) {
+                    mismatch = true;
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(my.Size() == my.ExactSize());
+    auto stats = my.GetRetryStats();
+    uint64_t by_slot = 0;
+    for (auto retries : stats.retries_by_slot) {
+        by_slot += retries;
+    }
+    REQUIRE(by_slot == stats.retries);
+}
+
+TEST_CASE("Multistress on a cache") {
+    const size_t kCapacity = 1'000;
+    SinkingCache<int, int> cache(kCapacity);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Zipf zipf{i, 10'000};
+            Random rand{i, 0, 999};
+            runner.Do([&cache, &mismatch, zipf, rand]() mutable {
+                int key = static_cast<int>(zipf());
+                auto choice = rand();
+                if (choice < 20) {
+                    cache.Erase(key);
+                } else if (auto value = cache.Get(key)) {
+                    if (*value % 10'000 != key) {
+                        mismatch = true;
+                    }
+                } else if (choice < 100) {
+                    cache.Put(key, key + 10'000 * rand(), std::chrono::microseconds(100));
+                } else {
+                    cache.Put(key, key + 10'000 * rand());
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(cache.Weight() == cache.Size());
+    REQUIRE(cache.Size() <= kCapacity);
+}
+
+TEST_CASE("Multistress on compact refs") {
+    CompactSinkingTree<uint64_t, uint64_t> my(8);
+    const auto kNumThreads = GENERATE(2u, 4u, 8u);
+
+    const int kNumIterations = 1'000'000;
+    std::atomic<bool> mismatch{false};
+
+    {
+        Runner runner{kNumIterations};
+        for (auto i : std::views::iota(0u, kNumThreads)) {
+            Random rand{i, 0, 999'999};
+            runner.Do([&my, &mismatch, rand, i]() mutable {
+                uint64_t key = rand() % 100'000;
+                auto choice = rand() % 1000;
+                // no Erase, only replacing Puts
+                if (choice < 300) {
+                    my.Put(key, key * 7 + 1'000'000 * i);
+                } else if (auto value = my.Get(key); value && *value % 1'000'000 != key * 7) {
+                    mismatch = true;
+                }
+            });
+        }
+    }
+    REQUIRE(!mismatch);
+    REQUIRE(my.Size() == my.ExactSize());
 }
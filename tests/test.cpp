@@ -1,12 +1,21 @@
+#include "compact_tree.h"
+#include "sinking_cache.h"
+#include "test_policies.h"
 #include "unordered_cc_map.h"
 
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 
 using namespace sinking_tree;
 
@@ -26,6 +35,31 @@ TEST_CASE("Basic") {
     REQUIRE(map.Erase(1));
 }
 
+TEST_CASE("Size") {
+    SinkingTree<int, int> my(16);
+    std::unordered_map<int, int> baseline;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> dist(0, 10'000);
+    REQUIRE(my.Empty());
+    for (int i = 0; i < 100'000; ++i) {
+        int key = dist(gen);
+        if (dist(gen) % 3 == 0) {
+            my.Erase(key);
+            baseline.erase(key);
+        } else {
+            my.Put(key, i);
+            baseline.insert_or_assign(key, i);
+        }
+        REQUIRE(my.Size() == baseline.size());
+    }
+    REQUIRE(my.ExactSize() == baseline.size());
+    for (auto [key, value] : baseline) {
+        REQUIRE(my.Erase(key));
+    }
+    REQUIRE(my.Empty());
+    REQUIRE(my.ExactSize() == 0);
+}
+
 TEST_CASE("Mix") {
     SinkingTree<int, int> my(16);
     std::unordered_map<int, int> baseline;
@@ -50,6 +84,67 @@ TEST_CASE("Mix") {
     }
 }
 
+TEST_CASE("Bulk operations") {
+    SinkingTree<int, int> my(16);
+    for (int i = 0; i < 100'000; ++i) {
+        REQUIRE(my.Put(i, 2 * i));
+    }
+    // more sweeps than there are hazard records, helper threads must give theirs back, the
+    // ones of the other map included
+    SinkingTree<int, int> other;
+    for (int round = 0; round < 100; ++round) {
+        std::atomic<int64_t> sum{0};
+        std::atomic<bool> consistent{true};
+        my.ParallelForEach(
+            [&sum, &consistent, &other](int key, int value) {
+                if (value != 2 * key) {
+                    consistent.store(false);
+                }
+                if (key % 1'000 == 0) {
+                    other.Put(key, value);
+                    other.Get(key);
+                }
+                sum.fetch_add(key);
+            },
+            4);
+        REQUIRE(consistent.load());
+        REQUIRE(sum.load() == int64_t{99'999} * 100'000 / 2);
+    }
+    REQUIRE(other.Size() == 100);
+    REQUIRE(my.EraseIf([](int key, int) { return key % 2 == 0; }, 4) == 50'000);
+    REQUIRE(my.Size() == 50'000);
+    REQUIRE(my.ExactSize() == 50'000);
+    for (int i = 0; i < 100'000; ++i) {
+        REQUIRE(my.Get(i).has_value() == (i % 2 == 1));
+    }
+    REQUIRE(my.EraseIf([](int, int) { return true; }, 3) == 50'000);
+    REQUIRE(my.Empty());
+
+    auto parallel = std::make_unique<SinkingTree<int, int>>();
+    for (int i = 0; i < 100'000; ++i) {
+        REQUIRE(parallel->Put(i, i));
+    }
+    parallel->SetDestructionThreads(4);
+    parallel.reset();
+}
+
+TEST_CASE("Clear") {
+    SinkingTree<int, int> my(16);
+    for (int round = 0; round < 300; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            REQUIRE(my.Put(i, round));
+        }
+        REQUIRE(my.Size() == 1000);
+        my.Clear(round % 2 == 0);
+        REQUIRE(my.Empty());
+        REQUIRE(my.ExactSize() == 0);
+        REQUIRE(!my.Get(round).has_value());
+        REQUIRE(!my.Erase(round));
+    }
+    REQUIRE(my.Put(1, 1));
+    REQUIRE(my.Get(1) == 1);
+}
+
 TEST_CASE("A lot of inserts") {
     SinkingTree<int, int> my;
     std::vector<int> x;
@@ -65,3 +160,463 @@ TEST_CASE("A lot of inserts") {
         REQUIRE(my.Erase(x[i]));
     }
 }
+
+TEST_CASE("Many instances") {
+    static constexpr auto kShards = 300;
+    std::vector<std::unique_ptr<SinkingTree<int, int>>> shards;
+    for (int i = 0; i < kShards; ++i) {
+        shards.push_back(std::make_unique<SinkingTree<int, int>>(16));
+    }
+    for (int i = 0; i < 100'000; ++i) {
+        REQUIRE(shards[i % kShards]->Put(i, i));
+    }
+    for (int i = 0; i < kShards; i += 2) {
+        shards[i]->CleanupHazard();
+        shards[i + 1].reset();
+    }
+    for (int i = 0; i < 100'000; ++i) {
+        if (i % kShards % 2 == 0) {
+            REQUIRE(shards[i % kShards]->Get(i) == i);
+            REQUIRE(!shards[i % kShards]->Put(i, -i));
+            REQUIRE(shards[i % kShards]->Erase(i));
+        }
+    }
+}
+
+TEST_CASE("String keys") {
+    SinkingTree<std::string, int> inline_keys(16);
+    SinkingTree<std::string, int, DefaultHasher<std::string>, PlainKeys> plain_keys(16);
+    std::unordered_map<std::string, int> baseline;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> dist(0, 5'000);
+    for (int i = 0; i < 100'000; ++i) {
+        // lengths from empty to a few cache lines
+        std::string key(dist(gen) % 150, 'a' + dist(gen) % 4);
+        key += std::to_string(dist(gen));
+        int op = dist(gen) % 10;
+        if (op < 3) {
+            auto base = baseline.insert_or_assign(key, i).second;
+            REQUIRE(inline_keys.Put(key, i) == base);
+            REQUIRE(plain_keys.Put(key, i) == base);
+        } else if (op < 5) {
+            auto base = baseline.erase(key) == 1;
+            REQUIRE(inline_keys.Erase(key) == base);
+            REQUIRE(plain_keys.Erase(key) == base);
+        } else {
+            auto base = baseline.find(key);
+            auto expected = base == baseline.end() ? std::nullopt : std::optional(base->second);
+            REQUIRE(inline_keys.Get(key) == expected);
+            REQUIRE(plain_keys.Get(key) == expected);
+        }
+    }
+    size_t visited = 0;
+    inline_keys.ParallelForEach([&visited, &baseline](std::string_view key, int value) {
+        ++visited;
+        REQUIRE(baseline.at(std::string(key)) == value);
+    });
+    REQUIRE(visited == baseline.size());
+}
+
+TEST_CASE("Packed entries") {
+    SinkingTree<uint32_t, uint16_t> packed(16);
+    SinkingTree<uint32_t, uint16_t, DefaultHasher<uint32_t>, NoPacking> nodes(16);
+    std::unordered_map<uint32_t, uint16_t> baseline;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<uint32_t> dist(0, 20'000);
+    // an all-zero entry must not look like an empty slot
+    REQUIRE(packed.Put(0, 0));
+    REQUIRE(packed.Get(0) == 0);
+    REQUIRE(packed.Erase(0));
+    REQUIRE(!packed.Get(0).has_value());
+    for (int i = 0; i < 200'000; ++i) {
+        uint32_t key = dist(gen) * 0x10001;
+        uint16_t value = dist(gen);
+        int op = dist(gen) % 10;
+        if (op < 4) {
+            auto base = baseline.insert_or_assign(key, value).second;
+            REQUIRE(packed.Put(key, value) == base);
+            REQUIRE(nodes.Put(key, value) == base);
+        } else if (op < 6) {
+            auto base = baseline.erase(key) == 1;
+            REQUIRE(packed.Erase(key) == base);
+            REQUIRE(nodes.Erase(key) == base);
+        } else {
+            auto base = baseline.find(key);
+            auto expected = base == baseline.end() ? std::nullopt : std::optional(base->second);
+            REQUIRE(packed.Get(key) == expected);
+            REQUIRE(nodes.Get(key) == expected);
+        }
+    }
+    REQUIRE(packed.ExactSize() == baseline.size());
+    size_t visited = 0;
+    packed.ParallelForEach([&visited, &baseline](uint32_t key, uint16_t value) {
+        ++visited;
+        REQUIRE(baseline.at(key) == value);
+    });
+    REQUIRE(visited == baseline.size());
+    REQUIRE(packed.EraseIf([](uint32_t key, uint16_t) { return key % 2 == 0; }) ==
+            nodes.EraseIf([](uint32_t key, uint16_t) { return key % 2 == 0; }));
+    REQUIRE(packed.ExactSize() == nodes.ExactSize());
+}
+
+TEST_CASE("Optimistic reads") {
+    SinkingTree<uint64_t, std::array<uint64_t, 3>, DefaultHasher<uint64_t>, OptimisticReads> map(
+        16);
+    std::unordered_map<uint64_t, std::array<uint64_t, 3>> baseline;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<uint64_t> dist(0, 20'000);
+    for (int i = 0; i < 200'000; ++i) {
+        uint64_t key = dist(gen) << 40;
+        std::array<uint64_t, 3> value{key, dist(gen), static_cast<uint64_t>(i)};
+        int op = dist(gen) % 10;
+        if (op < 4) {
+            REQUIRE(map.Put(key, value) == baseline.insert_or_assign(key, value).second);
+        } else if (op < 6) {
+            REQUIRE(map.Erase(key) == (baseline.erase(key) == 1));
+        } else {
+            auto base = baseline.find(key);
+            auto expected = base == baseline.end() ? std::nullopt : std::optional(base->second);
+            REQUIRE(map.Get(key) == expected);
+        }
+    }
+    REQUIRE(map.ExactSize() == baseline.size());
+    map.ParallelForEach([&baseline](uint64_t key, const std::array<uint64_t, 3>& value) {
+        REQUIRE(baseline.at(key) == value);
+    });
+}
+
+TEST_CASE("Optimistic reads of a reused node") {
+    using KV = OptimisticKV<uint64_t, std::array<uint64_t, 3>>;
+    KV::Lease lease;
+    std::atomic<void*> slot{KV::Make(1, {1, 1, 1}, 1)};
+    void* entry = slot.load();
+    // the entry is erased and its node reused for another one in the same slot, right when
+    // the reader looks the slot up again
+    struct ReusingSlot {
+        std::atomic<void*>& slot;
+        mutable bool reused{false};
+
+        void* load(std::memory_order order) const {
+            if (!std::exchange(reused, true)) {
+                KV::Free(slot.load());
+                void* other = KV::Make(2, {2, 2, 2}, 2);
+                REQUIRE(other == slot.load());
+                slot.store(other);
+            }
+            return slot.load(order);
+        }
+    };
+    std::optional<std::array<uint64_t, 3>> out;
+    REQUIRE_FALSE(KV::TryRead(entry, ReusingSlot{slot}, 1, 1, out));
+    REQUIRE(KV::TryRead(entry, slot, 2, 2, out));
+    REQUIRE(out == std::array<uint64_t, 3>{2, 2, 2});
+    KV::Free(slot.load());
+}
+
+TEST_CASE("Collapse") {
+    SinkingTree<int, int> map(16);
+    SinkingTree<int, int, DefaultHasher<int>, NoCollapse> kept(16);
+    std::unordered_map<int, int> baseline;
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> dist(0, 50'000);
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < 50'000; ++i) {
+            int key = dist(gen);
+            REQUIRE(map.Put(key, i) == baseline.insert_or_assign(key, i).second);
+            kept.Put(key, i);
+        }
+        for (int i = 0; i < 100'000; ++i) {
+            int key = dist(gen);
+            REQUIRE(map.Erase(key) == (baseline.erase(key) == 1));
+            kept.Erase(key);
+        }
+        for (const auto& [key, value] : baseline) {
+            REQUIRE(map.Get(key) == value);
+        }
+        REQUIRE(map.ExactSize() == baseline.size());
+    }
+    REQUIRE(map.GetShape().cells < kept.GetShape().cells);
+    REQUIRE(map.GetShape().max_depth <= kept.GetShape().max_depth);
+
+    for (const auto& [key, value] : baseline) {
+        REQUIRE(map.Erase(key));
+    }
+    // only the levels Sink may still promote into the root stay
+    auto shape = map.GetShape();
+    REQUIRE(map.ExactSize() == 0);
+    REQUIRE(shape.max_depth == 0);
+    REQUIRE(shape.cells < kept.GetShape().cells / 4);
+}
+
+TEST_CASE("Retry stats") {
+    SinkingTree<int, int, DefaultHasher<int>, RetryStatsPolicy> counted(16);
+    SinkingTree<int, int> plain(16);
+    for (int i = 0; i < 10'000; ++i) {
+        counted.Put(i, i);
+        plain.Put(i, i);
+        counted.Erase(i / 2);
+    }
+    // nobody to give way to on a single thread
+    auto stats = counted.GetRetryStats();
+    REQUIRE(stats.eliminated == 0);
+    REQUIRE(stats.retries_by_slot.size() == 256);
+    REQUIRE(plain.GetRetryStats().retries_by_slot.empty());
+    counted.ResetRetryStats();
+    REQUIRE(counted.GetRetryStats().retries == 0);
+}
+
+TEST_CASE("Cache") {
+    SECTION("Entry capacity") {
+        SinkingCache<int, int> cache(1'000);
+        for (int i = 0; i < 10'000; ++i) {
+            cache.Put(i, i);
+            REQUIRE(cache.Size() <= 1'000);
+        }
+        REQUIRE(cache.Weight() == cache.Size());
+        size_t hits = 0;
+        for (int i = 0; i < 10'000; ++i) {
+            if (auto value = cache.Get(i)) {
+                REQUIRE(*value == i);
+                ++hits;
+            }
+        }
+        REQUIRE(hits == cache.Size());
+        REQUIRE(cache.Erase(9'999));
+        REQUIRE(!cache.Erase(9'999));
+        REQUIRE(cache.Weight() == cache.Size());
+    }
+    SECTION("Tiny capacity") {
+        // too small to estimate the weight, every update goes to its total
+        SinkingCache<int, int> cache(3);
+        for (int i = 0; i < 100; ++i) {
+            cache.Put(i, i);
+            REQUIRE(cache.Size() <= 3);
+        }
+        REQUIRE(cache.Weight() == cache.Size());
+    }
+    SECTION("Second chance") {
+        SinkingCache<int, int> cache(1'000);
+        // the hand clears the bits of the first round and starts evicting
+        for (int i = 0; i < 1'100; ++i) {
+            cache.Put(i, i);
+        }
+        std::vector<int> referenced;
+        for (int i = 0; i < 200; ++i) {
+            if (cache.Get(i)) {
+                referenced.push_back(i);
+            }
+        }
+        REQUIRE(!referenced.empty());
+        for (int i = 1'100; i < 1'400; ++i) {
+            cache.Put(i, i);
+        }
+        for (int key : referenced) {
+            REQUIRE(cache.Get(key) == key);
+        }
+    }
+    SECTION("Byte capacity") {
+        SinkingCache<std::string, std::string> cache(
+            10'000, [](const std::string& key, const std::string& value) {
+                return key.size() + value.size();
+            });
+        REQUIRE(cache.Put("key", "small"));
+        REQUIRE(cache.Weight() == 8);
+        REQUIRE(!cache.Put("key", std::string(50, 'b')));
+        REQUIRE(cache.Weight() == 53);
+        REQUIRE(cache.Get("key") == std::string(50, 'b'));
+        for (int i = 0; i < 1'000; ++i) {
+            cache.Put(std::to_string(i), std::string(100, 'a' + i % 26));
+            REQUIRE(cache.Weight() <= 10'000);
+        }
+        REQUIRE(cache.Size() < 100);
+    }
+    SECTION("TTL") {
+        SinkingCache<int, int> cache(100);
+        cache.Put(1, 1, std::chrono::milliseconds(1));
+        cache.Put(2, 2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        REQUIRE(cache.Size() == 2);
+        REQUIRE(!cache.Get(1));
+        REQUIRE(cache.Size() == 1);
+        REQUIRE(cache.Weight() == 1);
+        REQUIRE(cache.Get(2) == 2);
+        cache.Put(1, 3, std::chrono::hours(1));
+        REQUIRE(cache.Get(1) == 3);
+    }
+}
+
+TEST_CASE("Compact refs") {
+    SECTION("Integer keys") {
+        CompactSinkingTree<uint64_t, uint64_t> map(16);
+        std::unordered_map<uint64_t, uint64_t> baseline;
+        std::mt19937 gen(0);
+        std::uniform_int_distribution<uint64_t> dist(0, 100'000);
+        for (int i = 0; i < 300'000; ++i) {
+            uint64_t key = dist(gen);
+            REQUIRE(map.Put(key, i) == baseline.insert_or_assign(key, i).second);
+        }
+        for (uint64_t key = 0; key <= 100'000; ++key) {
+            auto found = baseline.find(key);
+            if (found == baseline.end()) {
+                REQUIRE(!map.Get(key));
+            } else {
+                REQUIRE(map.Get(key) == found->second);
+            }
+        }
+        REQUIRE(map.Size() == baseline.size());
+        REQUIRE(map.ExactSize() == baseline.size());
+    }
+    SECTION("String keys") {
+        CompactSinkingTree<std::string, std::string> map;
+        for (int i = 0; i < 10'000; ++i) {
+            REQUIRE(map.Put(std::to_string(i), std::string(i % 50, 'x')));
+        }
+        for (int i = 0; i < 10'000; i += 2) {
+            REQUIRE(!map.Put(std::to_string(i), std::string(i % 50, 'y')));
+        }
+        for (int i = 0; i < 10'000; ++i) {
+            REQUIRE(map.Get(std::to_string(i)) == std::string(i % 50, i % 2 == 0 ? 'y' : 'x'));
+        }
+        REQUIRE(!map.Get("10000"));
+        REQUIRE(map.ExactSize() == 10'000);
+    }
+}
+
+TEST_CASE("Pooled memory") {
+    // the pools go with the last tree using them, the caches of the thread with them
+    for (int round = 0; round < 3; ++round) {
+        SinkingTree<uint64_t, std::array<uint64_t, 3>, DefaultHasher<uint64_t>, OptimisticReads>
+            map;
+        CompactSinkingTree<uint64_t, uint64_t> compact;
+        for (uint64_t key = 0; key < 10'000; ++key) {
+            REQUIRE(map.Put(key, {key, key, key}));
+            REQUIRE(compact.Put(key, key));
+        }
+        for (uint64_t key = 0; key < 10'000; key += 2) {
+            REQUIRE(map.Erase(key));
+            // replaced entries go back to the arena
+            REQUIRE(!compact.Put(key, key + 1));
+        }
+        for (uint64_t key = 0; key < 10'000; ++key) {
+            REQUIRE(map.Get(key).has_value() == (key % 2 == 1));
+            REQUIRE(compact.Get(key) == key + (key % 2 == 0 ? 1 : 0));
+        }
+    }
+}
+
+TEST_CASE("Merge and split") {
+    auto fill = [](auto& map, auto& baseline, int from, int to, int value) {
+        for (int key = from; key < to; ++key) {
+            map.Put(key, key + value);
+            baseline[key] = key + value;
+        }
+    };
+    auto check = [](auto& map, const auto& baseline) {
+        for (const auto& [key, value] : baseline) {
+            REQUIRE(map.Get(key) == value);
+        }
+        REQUIRE(map.ExactSize() == baseline.size());
+        REQUIRE(map.Size() == baseline.size());
+    };
+
+    SECTION("Merge") {
+        // roots of every width on either side
+        auto [lhs_capacity, rhs_capacity] = GENERATE(std::pair{2, 2}, std::pair{2, 1 << 12},
+                                                     std::pair{1 << 12, 2}, std::pair{64, 1 << 10});
+        SinkingTree<int, int> lhs(lhs_capacity);
+        SinkingTree<int, int> rhs(rhs_capacity);
+        std::unordered_map<int, int> baseline;
+        fill(lhs, baseline, 0, 60'000, 0);
+        std::unordered_map<int, int> ignored;
+        fill(rhs, ignored, 40'000, 100'000, 1);
+        fill(rhs, ignored, -10'000, 0, 1);
+        for (const auto& [key, value] : ignored) {
+            baseline[key] = value;
+        }
+
+        lhs.Merge(rhs);
+        check(lhs, baseline);
+        REQUIRE(rhs.Empty());
+        REQUIRE(rhs.ExactSize() == 0);
+        REQUIRE(!rhs.Get(50'000));
+
+        // both stay usable
+        fill(lhs, baseline, 100'000, 200'000, 2);
+        for (int key = 0; key < 10'000; ++key) {
+            REQUIRE(lhs.Erase(key));
+            baseline.erase(key);
+        }
+        check(lhs, baseline);
+        std::unordered_map<int, int> refilled;
+        fill(rhs, refilled, 0, 1'000, 3);
+        check(rhs, refilled);
+    }
+
+    SECTION("Merge keeps sinking") {
+        // the sunk roots of rhs stay behind, the merged tree must not count their cells
+        SinkingTree<int, int> lhs(2);
+        SinkingTree<int, int> rhs(2);
+        SinkingTree<int, int> fresh(2);
+        std::unordered_map<int, int> baseline;
+        fill(rhs, baseline, 0, 20'000, 0);
+        fill(fresh, baseline, 0, 20'000, 0);
+        lhs.Merge(rhs);
+        fill(lhs, baseline, 20'000, 100'000, 0);
+        fill(fresh, baseline, 20'000, 100'000, 0);
+        check(lhs, baseline);
+        auto merged_shape = lhs.GetShape();
+        auto fresh_shape = fresh.GetShape();
+        REQUIRE(merged_shape.max_depth == fresh_shape.max_depth);
+        REQUIRE(merged_shape.average_depth == fresh_shape.average_depth);
+    }
+
+    SECTION("Split") {
+        auto prefix_bits = GENERATE(1, 3, 12);
+        SinkingTree<int, int> lhs(1 << 6);
+        SinkingTree<int, int> rhs(2);
+        std::unordered_map<int, int> kept;
+        fill(lhs, kept, 0, 100'000, 0);
+        std::unordered_map<int, int> moved;
+        fill(rhs, moved, 200'000, 210'000, 0);
+
+        HashType half = static_cast<HashType>(1) << (prefix_bits - 1);
+        auto pred = [half](HashType prefix) { return prefix < half; };
+        for (auto it = kept.begin(); it != kept.end();) {
+            if (pred(DefaultHasher<int>()(it->first, 0) & ((half << 1) - 1))) {
+                moved.insert(*it);
+                it = kept.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        REQUIRE(lhs.Split(rhs, prefix_bits, pred) == 100'000 - kept.size());
+        check(lhs, kept);
+        check(rhs, moved);
+        for (const auto& [key, value] : moved) {
+            REQUIRE(!lhs.Get(key));
+        }
+
+        lhs.Merge(rhs);
+        for (const auto& [key, value] : moved) {
+            kept[key] = value;
+        }
+        check(lhs, kept);
+    }
+
+    SECTION("String keys") {
+        SinkingTree<std::string, int> lhs;
+        SinkingTree<std::string, int> rhs;
+        for (int i = 0; i < 10'000; ++i) {
+            (i % 2 ? lhs : rhs).Put(std::to_string(i), i);
+        }
+        rhs.Put("1", -1);
+        lhs.Merge(rhs);
+        REQUIRE(lhs.ExactSize() == 10'000);
+        REQUIRE(lhs.Get("1") == -1);
+        REQUIRE(lhs.Get("9998") == 9998);
+        REQUIRE(lhs.Split(rhs, 8, [](HashType) { return true; }) == 10'000);
+        REQUIRE(lhs.ExactSize() == 0);
+        REQUIRE(rhs.Get("9999") == 9999);
+    }
+}